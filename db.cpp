@@ -2,8 +2,14 @@
 #include "db.h"
 #include "SQLiteCpp/SQLiteCpp.h"
 #include "mvptable.h"
+#include "threadpool.h"
 
 #include <algorithm>
+#include <bitset>
+#include <queue>
+#include <unordered_set>
+#include <unordered_map>
+#include <filesystem>
 
 namespace imghash {
 
@@ -12,71 +18,315 @@ namespace imghash {
 		SQLStatementCache cache;
 
 		MVPTable table;
+
+		//the query hashes are prefixes of those in the database (see check_hash_type)
+		bool prefix;
+		bool read_only;
+		std::string path;
+		//the size of the prefix used to filter prefix queries: 64 bits, the size of the smallest DCT hash
+		static constexpr size_t coarse_size = 8;
+		//how long to wait for another connection's write (ms), e.g. another process adding images, or compacting
+		// rather than failing at once. Writes also begin IMMEDIATE, as a read transaction that then writes can't wait
+		static constexpr int busy_timeout = 60000;
 	public:
-		Impl(const std::string& path);
+		Impl(const std::string& path, bool read_only, const layout_options& layout);
+		void set_prefix(bool p) { prefix = p; }
+		bool is_read_only() const { return read_only; }
+		void set_query_threads(size_t n) { table.open_readers(path, n); }
 		void set_meta(const std::string& key, const std::string& value);
 		bool get_meta(const std::string& key, std::string& value);
 		void insert(const point_type& point, const item_type& item);
+		void insert(const entry& e);
+		void insert(const std::vector<entry>& entries);
+		std::unordered_map<item_type, file_info> file_infos();
+		std::vector<std::pair<Digest, point_type>> digests();
 		void rename(const item_type& item1, const item_type& item2);
 		void remove(const item_type& item);
 		bool exists(const item_type& item);
-		std::vector<query_result> query(const point_type& point, unsigned int dist, size_t limit = 10);
+		//the points of an image, in the order they were added, as entries with its file info, and the digest of a file
+		// with the same hash, if there is one
+		std::vector<entry> points_with_info(const item_type& item);
+		//no image has been added
+		bool is_empty();
+		//compact until the deadline, see Database::compact
+		bool compact(std::chrono::steady_clock::time_point deadline);
+		query_stats query(const point_type& point, unsigned int dist, size_t limit, const std::function<query_fn>& callback,
+			const query_budget& budget);
+		std::vector<std::vector<query_result>> query_batch(const std::vector<point_type>& points, unsigned int dist, size_t limit);
+	private:
+		//insert without balancing
+		void add(const point_type& point, const item_type& item, const file_info& info = {}, bool replace = false,
+			const std::optional<Digest>& digest = std::nullopt);
+		//balance and add vantage points as the table grows
+		void maintain();
+		//the number of points maintain() starts balancing at
+		static int64_t min_balance();
+		//the number of points compact() checks in each transaction
+		static constexpr int64_t compact_slice = 1000;
 	};
 
 	//Open the database
-	Database::Database(const std::string& path)
-		: impl(std::make_unique<Impl>(path))
+	Database::Database(const std::string& path, bool read_only, size_t num_shards, const layout_options& layout)
 	{
-		//nothing else to do
+		shards.push_back(std::make_unique<Impl>(path, read_only, layout));
+
+		//the first shard records how many there are
+		std::string value;
+		size_t stored = shards[0]->get_meta("shards", value) ? static_cast<size_t>(std::stoull(value)) : 1;
+		if (num_shards > 1 && stored == 1 && !read_only && shards[0]->is_empty()) {
+			shards[0]->set_meta("shards", std::to_string(num_shards));
+			stored = num_shards;
+		}
+		if (num_shards > 0 && num_shards != stored) {
+			throw std::runtime_error("Database has " + std::to_string(stored) + " shards, not " + std::to_string(num_shards));
+		}
+
+		for (size_t i = 1; i < stored; ++i) {
+			shards.push_back(std::make_unique<Impl>(path + "." + std::to_string(i), read_only, layout));
+		}
+		if (shards.size() > 1) pool = std::make_unique<ThreadPool>(shards.size());
 	}
 
 	//Close the database
 	Database::~Database()
 	{
-		//nothing else to do
+		//the pool goes first, as its workers use the shards
+		pool.reset();
 	}
 
-	bool Database::check_hash_type(const std::string& hash_type_str)
+	Database::Impl& Database::shard(const item_type& item)
 	{
-		std::string db_hash_type;
-		if (impl->get_meta("hash_type", db_hash_type)) {
-			return db_hash_type == hash_type_str;
+		if (shards.size() == 1) return *shards[0];
+		//stable across runs and platforms, unlike std::hash
+		auto d = digest(reinterpret_cast<const uint8_t*>(item.data()), item.size());
+		return *shards[static_cast<size_t>(d.h1 % shards.size())];
+	}
+
+	template<class F>
+	void Database::each_shard(F f)
+	{
+		if (shards.size() == 1) {
+			f(0, *shards[0]);
+			return;
 		}
-		else {
-			impl->set_meta("hash_type", hash_type_str);
-			return true;
+		std::vector<std::exception_ptr> errors(shards.size());
+		for (size_t i = 0; i < shards.size(); ++i) {
+			pool->submit([&, i]() {
+				try {
+					f(i, *shards[i]);
+				}
+				catch (...) {
+					errors[i] = std::current_exception();
+				}
+			});
+		}
+		pool->wait();
+		for (auto& e : errors) {
+			if (e) std::rethrow_exception(e);
 		}
 	}
 
+	void Database::set_query_threads(size_t n)
+	{
+		for (auto& s : shards) s->set_query_threads(n);
+	}
+
+	bool Database::check_hash_type(const std::string& hash_type_str, bool allow_prefix)
+	{
+		//every shard gets the type, so each can be checked on its own
+		for (auto& s : shards) {
+			std::string db_hash_type;
+			if (s->get_meta("hash_type", db_hash_type)) {
+				if (db_hash_type == hash_type_str) {
+					s->set_prefix(false);
+				}
+				else if (allow_prefix && DCTHasher::is_prefix(hash_type_str, db_hash_type)) {
+					s->set_prefix(true);
+				}
+				else {
+					return false;
+				}
+			}
+			else {
+				//a read only database that has no hash type has nothing to query either
+				if (!s->is_read_only()) s->set_meta("hash_type", hash_type_str);
+			}
+		}
+		return true;
+	}
+
 	//Add a file
 	void Database::insert(const point_type& point, const item_type& item)
 	{
-		impl->insert(point, item);
+		shard(item).insert(point, item);
+	}
+
+	void Database::insert(const entry& e)
+	{
+		shard(e.item).insert(e);
+	}
+
+	void Database::insert(const std::vector<entry>& entries)
+	{
+		if (shards.size() == 1) {
+			shards[0]->insert(entries);
+			return;
+		}
+		//each shard commits its part of the group, at the same time as the others
+		std::unordered_map<Impl*, std::vector<entry>> parts;
+		for (const auto& e : entries) parts[&shard(e.item)].push_back(e);
+		each_shard([&](size_t, Impl& s) {
+			auto part = parts.find(&s);
+			if (part != parts.end()) s.insert(part->second);
+		});
+	}
+
+	std::unordered_map<Database::item_type, Database::file_info> Database::file_infos()
+	{
+		std::unordered_map<item_type, file_info> infos;
+		for (auto& s : shards) infos.merge(s->file_infos());
+		return infos;
+	}
+
+	std::vector<std::pair<Digest, Database::point_type>> Database::digests()
+	{
+		std::vector<std::pair<Digest, point_type>> digests;
+		for (auto& s : shards) {
+			auto d = s->digests();
+			digests.insert(digests.end(), std::make_move_iterator(d.begin()), std::make_move_iterator(d.end()));
+		}
+		return digests;
 	}
 
 	void Database::rename(const item_type& item1, const item_type& item2)
 	{
-		impl->rename(item1, item2);
+		Impl& from = shard(item1);
+		Impl& to = shard(item2);
+		if (&from == &to) {
+			from.rename(item1, item2);
+			return;
+		}
+		//the new name belongs in another shard, so the image moves there, with its file info and digest
+		auto entries = from.points_with_info(item1);
+		if (entries.empty()) return;
+		for (auto& e : entries) e.item = item2;
+		//the points replace any the new name has, so that if the move is cut short between the shards
+		// renaming again finishes it
+		entries[0].replace = true;
+		bool existed = to.exists(item2);
+
+		//the image is removed from its shard only once it's committed to the other
+		to.insert(entries);
+		try {
+			from.remove(item1);
+		}
+		catch (...) {
+			//undo the insert, unless the name was already there
+			if (!existed) to.remove(item2);
+			throw;
+		}
 	}
 	void Database::remove(const item_type& item)
 	{
-		impl->remove(item);
+		shard(item).remove(item);
+	}
+	bool Database::compact(std::chrono::milliseconds budget)
+	{
+		auto deadline = budget.count() > 0 ? std::chrono::steady_clock::now() + budget : std::chrono::steady_clock::time_point::max();
+		//the shards compact at the same time, each within the budget
+		std::vector<char> done(shards.size());
+		each_shard([&](size_t i, Impl& s) {
+			done[i] = s.compact(deadline);
+		});
+		return std::all_of(done.begin(), done.end(), [](char d) { return d != 0; });
 	}
 	bool Database::exists(const item_type& item)
 	{
-		return impl->exists(item);
+		return shard(item).exists(item);
 	}
 
 	//Find similar images
 	std::vector<Database::query_result> Database::query(const point_type& point, unsigned int dist, size_t limit)
 	{
-		return impl->query(point, dist, static_cast<int64_t>(limit));
+		std::vector<query_result> result;
+		query(point, dist, limit, [&](const query_result& res) { result.push_back(res); }, {});
+		return result;
 	}
 
-	Database::Impl::Impl(const std::string& path)
-		: db(std::make_shared<SQLite::Database>(path, SQLite::OPEN_READWRITE | SQLite::OPEN_CREATE)),
-		table(db, Hasher::distance), cache(db)
+	Database::query_stats Database::query(const point_type& point, unsigned int dist, size_t limit, const std::function<query_fn>& callback,
+		const query_budget& budget)
 	{
+		if (shards.size() == 1) return shards[0]->query(point, dist, limit, callback, budget);
+
+		//each shard finds its nearest `limit`, and the nearest of those are the nearest of all
+		std::vector<std::vector<query_result>> found(shards.size());
+		std::vector<query_stats> shard_stats(shards.size());
+		each_shard([&](size_t i, Impl& s) {
+			shard_stats[i] = s.query(point, dist, limit, [&](const query_result& res) { found[i].push_back(res); }, budget);
+		});
+
+		query_stats stats;
+		std::vector<query_result> merged;
+		for (size_t i = 0; i < shards.size(); ++i) {
+			stats.partitions += shard_stats[i].partitions;
+			stats.partitions_scanned += shard_stats[i].partitions_scanned;
+			stats.points_scanned += shard_stats[i].points_scanned;
+			stats.complete = stats.complete && shard_stats[i].complete;
+			merged.insert(merged.end(), std::make_move_iterator(found[i].begin()), std::make_move_iterator(found[i].end()));
+		}
+		std::stable_sort(merged.begin(), merged.end(),
+			[](const query_result& a, const query_result& b) { return std::get<0>(a) < std::get<0>(b); });
+		if (merged.size() > limit) merged.resize(limit);
+		for (const auto& res : merged) callback(res);
+		return stats;
+	}
+
+	std::vector<std::vector<Database::query_result>> Database::query_batch(const std::vector<point_type>& points, unsigned int dist, size_t limit)
+	{
+		if (shards.size() == 1) return shards[0]->query_batch(points, dist, limit);
+
+		std::vector<std::vector<std::vector<query_result>>> found(shards.size());
+		each_shard([&](size_t i, Impl& s) {
+			found[i] = s.query_batch(points, dist, limit);
+		});
+
+		std::vector<std::vector<query_result>> results(points.size());
+		for (size_t q = 0; q < points.size(); ++q) {
+			auto& merged = results[q];
+			for (auto& f : found) {
+				merged.insert(merged.end(), std::make_move_iterator(f[q].begin()), std::make_move_iterator(f[q].end()));
+			}
+			std::stable_sort(merged.begin(), merged.end(),
+				[](const query_result& a, const query_result& b) { return std::get<0>(a) < std::get<0>(b); });
+			if (merged.size() > limit) merged.resize(limit);
+		}
+		return results;
+	}
+
+	Database::Impl::Impl(const std::string& path, bool read_only, const layout_options& layout)
+		: db(std::make_shared<SQLite::Database>(path, read_only ? SQLite::OPEN_READONLY : SQLite::OPEN_READWRITE | SQLite::OPEN_CREATE,
+			busy_timeout)),
+		table(db, Hasher::distance, [](const point_type& p, const point_type& ps, size_t stride, uint32_t* out) {
+			Hasher::hamming_distance(p, ps, stride, out);
+		}, [](int64_t k1, int64_t k2) {
+			//the keys are 64-bit hashes, so their distance is a single popcount
+			return static_cast<int32_t>(std::bitset<64>(static_cast<uint64_t>(k1 ^ k2)).count());
+		}, read_only, MVPTable::layout_options{ layout.packed, layout.clustered }),
+		cache(db), prefix(false), read_only(read_only), path(path)
+	{
+		if (read_only) {
+			//pages are read straight from the mapped file rather than copied into the page cache,
+			// and sorts spill to memory rather than to temporary files
+			std::error_code ec;
+			auto size = std::filesystem::file_size(path, ec);
+			if (!ec && size > 0) db->exec("PRAGMA mmap_size = " + std::to_string(size) + ";");
+			db->exec("PRAGMA temp_store = MEMORY;");
+			return;
+		}
+
+		//readers (other processes, or query threads) don't wait for a writer, nor it for them
+		db->exec("PRAGMA journal_mode = WAL;");
+
 		db->exec(
 			"CREATE TABLE IF NOT EXISTS meta ("
 				"key TEXT UNIQUE,"
@@ -85,7 +335,10 @@ namespace imghash {
 			"CREATE TABLE IF NOT EXISTS images ("
 				"id INTEGER PRIMARY KEY,"
 				"path TEXT,"
-				"count INTEGER"
+				"count INTEGER,"
+				"size INTEGER,"
+				"mtime INTEGER,"
+				"inode INTEGER"
 			");"
 			"CREATE UNIQUE INDEX IF NOT EXISTS idx_images_path ON images(path);"
 			"CREATE TABLE IF NOT EXISTS map_images_points ("
@@ -95,7 +348,26 @@ namespace imghash {
 				"FOREIGN KEY (image_id) REFERENCES images(id),"
 				"FOREIGN KEY (point_id) REFERENCES mvp_points(id)"
 			");"
+			"CREATE INDEX IF NOT EXISTS idx_map_images_points_point ON map_images_points(point_id);"
+			"CREATE TABLE IF NOT EXISTS digests ("
+				"digest BLOB PRIMARY KEY,"
+				"hash BLOB"
+			") WITHOUT ROWID;"
 		);
+
+		//databases from before file info was kept get the columns, left NULL for the images already there
+		bool has_info = false;
+		SQLite::Statement columns(*db, "PRAGMA table_info(images);");
+		while (columns.executeStep()) {
+			if (columns.getColumn("name").getString() == "size") has_info = true;
+		}
+		if (!has_info) {
+			db->exec(
+				"ALTER TABLE images ADD COLUMN size INTEGER;"
+				"ALTER TABLE images ADD COLUMN mtime INTEGER;"
+				"ALTER TABLE images ADD COLUMN inode INTEGER;"
+			);
+		}
 	}
 
 	void Database::Impl::set_meta(const std::string& key, const std::string& value) {
@@ -132,12 +404,16 @@ namespace imghash {
 		auto& sel_id = cache["SELECT id FROM images WHERE path = $path;"];
 		sel_id.bind("$path", item);
 		auto id = cache.exec_getInt64(sel_id, "id");
-		auto& del = cache[
-			"DELETE FROM map_images_points WHERE image_id = $id;"
-			"DELETE FROM images WHERE id = $id;"
-		];
-		del.bind("$id", id);
-		cache.exec(del);
+		//a prepared statement only runs its first command, so each DELETE is a statement of its own
+		// the image's points are left in mvp_points, for compact() to remove
+		SQLite::Transaction transaction(*db, SQLite::TransactionBehavior::IMMEDIATE);
+		auto& del_map = cache["DELETE FROM map_images_points WHERE image_id = $id;"];
+		del_map.bind("$id", id);
+		cache.exec(del_map);
+		auto& del_image = cache["DELETE FROM images WHERE id = $id;"];
+		del_image.bind("$id", id);
+		cache.exec(del_image);
+		transaction.commit();
 	}
 	bool Database::Impl::exists(const item_type& item)
 	{
@@ -152,24 +428,240 @@ namespace imghash {
 			return false;
 		}
 	}
+	std::vector<Database::entry> Database::Impl::points_with_info(const item_type& item)
+	{
+		std::vector<entry> entries;
+		auto& sel = cache[
+			"SELECT mvp_points.value, images.size, images.mtime, images.inode FROM images "
+			"JOIN map_images_points ON map_images_points.image_id = images.id "
+			"JOIN mvp_points ON mvp_points.id = map_images_points.point_id "
+			"WHERE images.path = $path ORDER BY map_images_points.image_n;"
+		];
+		sel.bind("$path", item);
+		while (sel.executeStep()) {
+			entry e;
+			e.item = item;
+			auto v = sel.getColumn(0);
+			auto data = static_cast<const uint8_t*>(v.getBlob());
+			e.point.assign(data, data + v.getBytes());
+			//images added without their file info have none
+			if (!sel.getColumn(1).isNull()) {
+				e.info.size = sel.getColumn(1).getInt64();
+				e.info.mtime = sel.getColumn(2).getInt64();
+				e.info.inode = sel.getColumn(3).getInt64();
+			}
+			entries.push_back(std::move(e));
+		}
+		sel.reset();
+
+		//the digests are by file, not by image, so any file with the same hash has one that will do
+		auto& sel_digest = cache["SELECT digest FROM digests WHERE hash = $hash LIMIT 1;"];
+		for (auto& e : entries) {
+			sel_digest.bind("$hash", e.point.data(), static_cast<int>(e.point.size()));
+			if (sel_digest.executeStep()) {
+				auto d = sel_digest.getColumn(0);
+				if (d.getBytes() == static_cast<int>(Digest::size)) e.digest = Digest::from_bytes(static_cast<const uint8_t*>(d.getBlob()));
+			}
+			sel_digest.reset();
+		}
+		return entries;
+	}
+
+	bool Database::Impl::is_empty()
+	{
+		auto& sel = cache["SELECT 1 FROM images LIMIT 1;"];
+		bool empty = !sel.executeStep();
+		sel.reset();
+		return empty;
+	}
+
 	void Database::Impl::insert(const point_type& point, const item_type& path)
 	{
-		// the first point inserted will also be the first vantage point
-		if (table.count_vantage_points() == 0) {
-			table.insert_vantage_point(point);
+		add(point, path);
+		maintain();
+	}
+
+	void Database::Impl::insert(const entry& e)
+	{
+		add(e.point, e.item, e.info, e.replace, e.digest);
+		maintain();
+	}
+
+	void Database::Impl::insert(const std::vector<entry>& entries)
+	{
+		SQLite::Transaction transaction(*db, SQLite::TransactionBehavior::IMMEDIATE);
+		for (const auto& e : entries) {
+			add(e.point, e.item, e.info, e.replace, e.digest);
 		}
-		
-		auto point_id = table.insert_point(point);
+		maintain();
+		transaction.commit();
+	}
+
+	std::unordered_map<Database::item_type, Database::file_info> Database::Impl::file_infos()
+	{
+		std::unordered_map<item_type, file_info> infos;
+		auto& sel = cache["SELECT path, size, mtime, inode FROM images WHERE size IS NOT NULL;"];
+		while (sel.executeStep()) {
+			file_info info;
+			info.size = sel.getColumn(1).getInt64();
+			info.mtime = sel.getColumn(2).getInt64();
+			info.inode = sel.getColumn(3).getInt64();
+			infos.emplace(sel.getColumn(0).getString(), info);
+		}
+		sel.reset();
+		return infos;
+	}
 
+	int64_t Database::Impl::min_balance()
+	{
+#ifdef _DEBUG
+		return 20;
+#else
+		return 50;
+#endif
+	}
+
+	void Database::Impl::maintain()
+	{
 #ifdef _DEBUG
-		int64_t min_balance = 20;
 		int64_t vp_target = 5;
 #else
-		int64_t min_balance = 50;
 		int64_t vp_target = 100;
 #endif
-		table.auto_balance(min_balance, 0.5f);
+		table.auto_balance(min_balance(), 0.5f);
 		table.auto_vantage_point(vp_target);
+	}
+
+	bool Database::Impl::compact(std::chrono::steady_clock::time_point deadline)
+	{
+		//the steps, in order. The step reached, and how far through it, are kept in meta so another run can carry on
+		enum { orphan_images, orphan_points, recount, vantage_points, reindex, vacuum };
+		std::string value;
+		int step = get_meta("compact_step", value) ? std::stoi(value) : orphan_images;
+		int64_t cursor = get_meta("compact_cursor", value) ? std::stoll(value) : 0;
+		auto next_step = [&]() {
+			++step;
+			cursor = 0;
+			set_meta("compact_step", std::to_string(step));
+			set_meta("compact_cursor", "0");
+		};
+		//at least one transaction is committed each time, so every run makes progress
+		auto out_of_time = [&]() { return std::chrono::steady_clock::now() >= deadline; };
+
+		if (step == orphan_images) {
+			//images whose points were all dropped, as by remove before it deleted the image too
+			SQLite::Transaction transaction(*db, SQLite::TransactionBehavior::IMMEDIATE);
+			cache.exec("DELETE FROM images WHERE id IN (SELECT id FROM images EXCEPT SELECT image_id FROM map_images_points);");
+			next_step();
+			transaction.commit();
+			if (out_of_time()) return false;
+		}
+
+		while (step == orphan_points) {
+			//the points after the cursor, a slice at a time, removing those no image refers to
+			SQLite::Transaction transaction(*db, SQLite::TransactionBehavior::IMMEDIATE);
+			auto& sel_points = cache[
+				"SELECT id, EXISTS(SELECT 1 FROM map_images_points WHERE point_id = mvp_points.id) FROM mvp_points "
+				"WHERE id > $cursor ORDER BY id LIMIT $limit;"
+			];
+			sel_points.bind("$cursor", cursor);
+			sel_points.bind("$limit", compact_slice);
+			std::vector<int64_t> unused;
+			int64_t n = 0;
+			while (sel_points.executeStep()) {
+				cursor = sel_points.getColumn(0).getInt64();
+				if (sel_points.getColumn(1).getInt() == 0) unused.push_back(cursor);
+				++n;
+			}
+			sel_points.reset();
+			for (auto id : unused) table.remove_point(id);
+			if (n < compact_slice) {
+				next_step();
+			}
+			else {
+				set_meta("compact_cursor", std::to_string(cursor));
+			}
+			transaction.commit();
+			if (out_of_time()) return false;
+		}
+
+		if (step == recount) {
+			SQLite::Transaction transaction(*db, SQLite::TransactionBehavior::IMMEDIATE);
+			table.recount();
+			next_step();
+			transaction.commit();
+			if (out_of_time()) return false;
+		}
+
+		while (step == vantage_points) {
+			//the vantage points after the cursor, one at a time, as each is a pass over all of the points
+			auto vp_ids = table.vantage_point_ids();
+			auto vp_id = std::upper_bound(vp_ids.begin(), vp_ids.end(), cursor);
+			SQLite::Transaction transaction(*db, SQLite::TransactionBehavior::IMMEDIATE);
+			if (vp_id == vp_ids.end()) {
+				next_step();
+			}
+			else {
+				cursor = *vp_id;
+				//the points removed may have left its shells uneven. If balancing doesn't even them out, so many points
+				// are at the same distance from it that it hardly splits them, and another is picked in its place
+				if (table.is_degraded(cursor, min_balance(), 0.5f)) {
+					table.balance(cursor);
+					if (table.is_degraded(cursor, min_balance(), 0.5f)) table.reselect_vantage_point(cursor);
+				}
+				set_meta("compact_cursor", std::to_string(cursor));
+			}
+			transaction.commit();
+			if (out_of_time()) return false;
+		}
+
+		if (step == reindex) {
+			//the indexes are rebuilt, packed full, rather than left with the gaps of the rows deleted
+			SQLite::Transaction transaction(*db, SQLite::TransactionBehavior::IMMEDIATE);
+			db->exec("REINDEX;");
+			next_step();
+			transaction.commit();
+			if (out_of_time()) return false;
+		}
+
+		//VACUUM can't be in a transaction. The step is only cleared once it's done, so if it fails, the next run
+		// tries it again
+		db->exec("VACUUM;");
+		//the pages VACUUM wrote go from the WAL to the file, and the WAL is cut back
+		db->exec("PRAGMA wal_checkpoint(TRUNCATE);");
+		cache.exec("DELETE FROM meta WHERE key IN ('compact_step', 'compact_cursor');");
+		return true;
+	}
+
+	std::vector<std::pair<Digest, Database::point_type>> Database::Impl::digests()
+	{
+		std::vector<std::pair<Digest, point_type>> digests;
+		if (prefix) return digests;
+		auto& sel = cache["SELECT digest, hash FROM digests;"];
+		while (sel.executeStep()) {
+			auto d = sel.getColumn(0);
+			auto h = sel.getColumn(1);
+			if (d.getBytes() != static_cast<int>(Digest::size)) continue;
+			auto hash = static_cast<const uint8_t*>(h.getBlob());
+			digests.emplace_back(Digest::from_bytes(static_cast<const uint8_t*>(d.getBlob())), point_type(hash, hash + h.getBytes()));
+		}
+		sel.reset();
+		return digests;
+	}
+
+	void Database::Impl::add(const point_type& point, const item_type& path, const file_info& info, bool replace,
+		const std::optional<Digest>& digest)
+	{
+		if (prefix) {
+			throw std::runtime_error("Can't insert prefix hashes into the database");
+		}
+
+		// the first point inserted will also be the first vantage point
+		if (table.count_vantage_points() == 0) {
+			table.insert_vantage_point(point);
+		}
+		
+		auto point_id = table.insert_point(point);
 
 		//is the path already in images?
 		auto& sel_image = cache["SELECT id, count FROM images WHERE path = $path;"];
@@ -181,10 +673,19 @@ namespace imghash {
 			image_id = sel_image.getColumn("id").getInt64();
 			image_count = sel_image.getColumn("count").getInt();
 			sel_image.reset();
-			//we're adding a new point to the image, so increment its count
-			auto& inc_count = cache["UPDATE images SET count = count + 1 WHERE id = $id;"];
-			inc_count.bind("$id", image_id);
-			cache.exec(inc_count);
+			if (replace) {
+				//the file has changed, so its old points no longer belong to it
+				// they're left in the table, where no image refers to them, until compact() removes them
+				auto& del_map = cache["DELETE FROM map_images_points WHERE image_id = $id;"];
+				del_map.bind("$id", image_id);
+				cache.exec(del_map);
+				image_count = 0;
+			}
+			//we're adding a new point to the image, so count it
+			auto& set_count = cache["UPDATE images SET count = $count WHERE id = $id;"];
+			set_count.bind("$count", image_count + 1);
+			set_count.bind("$id", image_id);
+			cache.exec(set_count);
 		}
 		else {
 			sel_image.reset();
@@ -194,6 +695,22 @@ namespace imghash {
 			image_id = cache.exec_getInt64(ins_image, "id");
 			image_count = 0;
 		}
+		if (info.size >= 0) {
+			auto& set_info = cache["UPDATE images SET size = $size, mtime = $mtime, inode = $inode WHERE id = $id;"];
+			set_info.bind("$size", info.size);
+			set_info.bind("$mtime", info.mtime);
+			set_info.bind("$inode", info.inode);
+			set_info.bind("$id", image_id);
+			cache.exec(set_info);
+		}
+		if (digest) {
+			uint8_t bytes[Digest::size];
+			digest->to_bytes(bytes);
+			auto& ins_digest = cache["INSERT OR IGNORE INTO digests(digest, hash) VALUES($digest, $hash);"];
+			ins_digest.bind("$digest", bytes, static_cast<int>(Digest::size));
+			ins_digest.bind("$hash", point.data(), static_cast<int>(point.size()));
+			cache.exec(ins_digest);
+		}
 		auto& ins_map = cache[
 			"INSERT INTO map_images_points(image_id, point_id, image_n)"
 				"VALUES($img_id, $pt_id, $img_n);"
@@ -204,32 +721,256 @@ namespace imghash {
 		cache.exec(ins_map);
 	}
 
-	std::vector<Database::query_result> Database::Impl::query(const point_type& point, unsigned int dist, size_t limit)
+	Database::query_stats Database::Impl::query(const point_type& point, unsigned int dist, size_t limit, const std::function<query_fn>& callback,
+		const query_budget& budget)
 	{
-		//table.query populates temp.mvp_query(id, dist)
+		if (limit == 0) return {};
+
+		//table.query visits the partitions nearest first, passing the points (id, dist) found in each
 		// where the ids refer to point_id in map_images_points
 		// If an image has multiple point entries (as in a video) we want only the best matching one
-		table.query(point, dist);
-		auto& sel_query = cache[
-			"WITH image_query AS ("
-				"SELECT m.image_id AS id, m.image_n AS n, MIN(q.dist) AS dist "
-				"FROM map_images_points m, temp.mvp_query q ON q.id = m.point_id "
-				"GROUP BY m.image_id"
-			") SELECT i.path AS path, iq.n AS n, iq.dist AS dist "
-			"FROM images i, image_query iq ON i.id = iq.id "
-			"ORDER BY dist LIMIT $limit;"
-		];
+		auto& sel_images = cache["SELECT image_id, image_n FROM map_images_points WHERE point_id = $id;"];
+		auto& sel_path = cache["SELECT path FROM images WHERE id = $id;"];
 
-		std::vector<query_result> result;
-		
-		sel_query.bind("$limit", static_cast<int64_t>(limit));
-		while (sel_query.executeStep()) {
-			std::string path = sel_query.getColumn("path").getString();
-			int32_t dist = sel_query.getColumn("dist").getInt();
-			int32_t n = sel_query.getColumn("n").getInt();
-			result.emplace_back(dist, std::move(path), n);
-		}
-		sel_query.reset();
-		return result;
+		//min-heap of candidate matches (dist, image_id, image_n)
+		using candidate = std::tuple<int32_t, int64_t, int32_t>;
+		std::priority_queue<candidate, std::vector<candidate>, std::greater<candidate>> heap;
+		std::unordered_set<int64_t> found;
+		size_t count = 0;
+
+		MVPTable::query_budget table_budget{};
+		table_budget.partitions = static_cast<int64_t>(budget.partitions);
+		table_budget.points = static_cast<int64_t>(budget.points);
+		auto stats_of = [](const MVPTable::query_stats& table_stats) {
+			query_stats stats;
+			stats.partitions = static_cast<size_t>(table_stats.partitions);
+			stats.partitions_scanned = static_cast<size_t>(table_stats.partitions_scanned);
+			stats.points_scanned = static_cast<size_t>(table_stats.points_scanned);
+			stats.complete = table_stats.complete;
+			return stats;
+		};
+
+		auto visit = [&](const std::vector<MVPTable::query_point>& points, int32_t bound) {
+			for (const auto& p : points) {
+				sel_images.bind("$id", p.id);
+				while (sel_images.executeStep()) {
+					heap.emplace(p.dist, sel_images.getColumn(0).getInt64(), sel_images.getColumn(1).getInt());
+				}
+				sel_images.reset();
+			}
+			//no point left to visit is closer than bound, so any candidate below it is final
+			while (!heap.empty() && std::get<0>(heap.top()) < bound) {
+				auto [d, image_id, n] = heap.top();
+				heap.pop();
+				//the first match popped for an image is its best
+				if (!found.insert(image_id).second) continue;
+
+				sel_path.bind("$id", image_id);
+				if (sel_path.executeStep()) {
+					std::string path = sel_path.getColumn(0).getString();
+					sel_path.reset();
+					callback(query_result(d, std::move(path), n));
+					if (++count >= limit) return false;
+				}
+				else {
+					sel_path.reset();
+				}
+			}
+			return true;
+		};
+
+		if (prefix) {
+			//the vantage point distances are over the whole hash, so they can't bound a prefix query
+			// instead filter all of the points on the coarse prefix, then rank them by the whole query
+			point_type coarse(point.begin(), point.begin() + std::min(point.size(), coarse_size));
+			MVPTable::query_stats table_stats;
+			auto points = table.query_scan(point, coarse, dist, table_budget, table_stats);
+			visit(points, static_cast<int32_t>(dist) + 1);
+			return stats_of(table_stats);
+		}
+
+		if (dist == 0) {
+			//only the same hash is at distance 0, and the unique index on the points finds it without a scan
+			int64_t id;
+			if (table.find_point(point, id)) visit({ { id, 0 } }, 1);
+			return {};
+		}
+
+		return stats_of(table.query(point, dist, visit, table_budget));
+	}
+
+	std::vector<std::vector<Database::query_result>> Database::Impl::query_batch(const std::vector<point_type>& points, unsigned int dist, size_t limit)
+	{
+		if (prefix) {
+			std::vector<std::vector<query_result>> results;
+			for (const auto& point : points) {
+				results.emplace_back();
+				query(point, dist, limit, [&](const query_result& res) { results.back().push_back(res); }, {});
+			}
+			return results;
+		}
+
+		//table.query_batch gets the points (id, dist) found for each query
+		// where the ids refer to point_id in map_images_points
+		std::vector<std::vector<MVPTable::query_point>> found;
+		if (dist == 0) {
+			//exact matches are looked up, as in query
+			found.resize(points.size());
+			for (size_t i = 0; i < points.size(); ++i) {
+				int64_t id;
+				if (table.find_point(points[i], id)) found[i].push_back({ id, 0 });
+			}
+		}
+		else {
+			found = table.query_batch(points, dist);
+		}
+
+		auto& sel_images = cache["SELECT image_id, image_n FROM map_images_points WHERE point_id = $id;"];
+		auto& sel_path = cache["SELECT path FROM images WHERE id = $id;"];
+
+		//queries in a batch (e.g. consecutive video frames) tend to find the same points, so look each up only once
+		std::unordered_map<int64_t, std::vector<std::pair<int64_t, int32_t>>> point_images;
+		std::unordered_map<int64_t, std::string> image_paths;
+
+		std::vector<std::vector<query_result>> results(points.size());
+		for (size_t i = 0; i < points.size(); ++i) {
+			//If an image has multiple point entries (as in a video) we want only the best matching one
+			std::unordered_map<int64_t, std::pair<int32_t, int32_t>> best; //image_id -> (dist, image_n)
+			for (const auto& p : found[i]) {
+				auto pi = point_images.find(p.id);
+				if (pi == point_images.end()) {
+					pi = point_images.emplace(p.id, std::vector<std::pair<int64_t, int32_t>>()).first;
+					sel_images.bind("$id", p.id);
+					while (sel_images.executeStep()) {
+						pi->second.emplace_back(sel_images.getColumn(0).getInt64(), sel_images.getColumn(1).getInt());
+					}
+					sel_images.reset();
+				}
+				for (const auto& img : pi->second) {
+					auto b = best.try_emplace(img.first, p.dist, img.second);
+					if (!b.second && p.dist < b.first->second.first) {
+						b.first->second = { p.dist, img.second };
+					}
+				}
+			}
+
+			//(dist, image_id, image_n), in the same order as query
+			std::vector<std::tuple<int32_t, int64_t, int32_t>> matches;
+			matches.reserve(best.size());
+			for (const auto& b : best) matches.emplace_back(b.second.first, b.first, b.second.second);
+			std::sort(matches.begin(), matches.end());
+
+			for (const auto& m : matches) {
+				if (results[i].size() >= limit) break;
+				auto image_id = std::get<1>(m);
+				auto path = image_paths.find(image_id);
+				if (path == image_paths.end()) {
+					sel_path.bind("$id", image_id);
+					if (!sel_path.executeStep()) {
+						sel_path.reset();
+						continue;
+					}
+					path = image_paths.emplace(image_id, sel_path.getColumn(0).getString()).first;
+					sel_path.reset();
+				}
+				results[i].emplace_back(std::get<0>(m), path->second, std::get<2>(m));
+			}
+		}
+		return results;
+	}
+
+	DatabaseWriter::DatabaseWriter(Database& db, std::function<done_fn> done, size_t group_size, std::chrono::milliseconds group_time)
+		: db(db), done(std::move(done)), group_size(group_size > 0 ? group_size : 1), group_time(group_time), closed(false)
+	{
+		thread = std::thread(&DatabaseWriter::run, this);
+	}
+
+	DatabaseWriter::~DatabaseWriter()
+	{
+		try {
+			finish();
+		}
+		catch (...) {
+			//nowhere to report it
+		}
+	}
+
+	void DatabaseWriter::push(Database::point_type point, Database::item_type item)
+	{
+		Database::entry e;
+		e.point = std::move(point);
+		e.item = std::move(item);
+		push(std::move(e));
+	}
+
+	void DatabaseWriter::push(Database::entry e)
+	{
+		{
+			//hold the producer back to the pace of the database, up to two groups ahead
+			std::unique_lock<std::mutex> lock(mutex);
+			cv_pop.wait(lock, [&] { return error || queue.size() < 2 * group_size; });
+			if (error) std::rethrow_exception(error);
+			queue.push_back(std::move(e));
+		}
+		cv_push.notify_one();
+	}
+
+	void DatabaseWriter::finish()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			closed = true;
+		}
+		cv_push.notify_one();
+		if (thread.joinable()) thread.join();
+		check_error();
+	}
+
+	void DatabaseWriter::check_error()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (error) std::rethrow_exception(error);
+	}
+
+	void DatabaseWriter::run()
+	{
+		std::vector<Database::entry> group;
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				cv_push.wait(lock, [&] { return closed || !queue.empty(); });
+				if (queue.empty()) return; //closed, and nothing left to commit
+
+				//gather a group, until it's full or its time is up
+				auto deadline = std::chrono::steady_clock::now() + group_time;
+				while (group.size() < group_size) {
+					if (queue.empty()) {
+						if (closed) break;
+						if (!cv_push.wait_until(lock, deadline, [&] { return closed || !queue.empty(); })) break;
+						continue;
+					}
+					group.push_back(std::move(queue.front()));
+					queue.pop_front();
+				}
+			}
+			cv_pop.notify_all();
+
+			try {
+				db.insert(group);
+				if (done) {
+					for (const auto& e : group) done(e.point, e.item);
+				}
+			}
+			catch (...) {
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					error = std::current_exception();
+					queue.clear();
+				}
+				cv_pop.notify_all();
+				return;
+			}
+			group.clear();
+		}
 	}
-}
\ No newline at end of file
+}
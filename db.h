@@ -1,39 +1,186 @@
 
 #pragma once
 #include "imghash.h"
+#include "digest.h"
 
 #include <string>
 #include <utility>
 #include <memory>
+#include <functional>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <optional>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
 
 namespace imghash {
 
+	class ThreadPool;
+
 	class Database {
 		class Impl;
-		std::unique_ptr<Impl> impl;
+		//images are spread over the shards by a hash of their path, and a query asks all of them
+		std::vector<std::unique_ptr<Impl>> shards;
+		std::unique_ptr<ThreadPool> pool; //runs the shards in parallel, if there's more than one
+
+		Impl& shard(const std::string& item);
+		//call f(i, shard) for each shard, in parallel, rethrowing the first error
+		template<class F>
+		void each_shard(F f);
 	public:
 		using point_type = Hasher::hash_type;
 		using item_type = std::string;
 		using query_result = std::tuple<int32_t, item_type, int32_t>;
+		using query_fn = void (const query_result&);
+
+		//Limits on the work done by an approximate query, zero means no limit
+		struct query_budget {
+			size_t partitions; //the number of partitions to scan, nearest first
+			size_t points; //the number of distance evaluations
+		};
+
+		//A file's size, modification time and inode, to tell whether it has changed since it was added
+		using file_info = FileInfo;
+
+		//An image to add, with its file's info and digest if known
+		// with replace, the points the image had before are dropped, as when its file has changed
+		struct entry {
+			point_type point;
+			item_type item;
+			file_info info;
+			std::optional<Digest> digest;
+			bool replace = false;
+		};
+
+		//How much of the database a query covered
+		struct query_stats {
+			size_t partitions = 0; //partitions within the query distance
+			size_t partitions_scanned = 0;
+			size_t points_scanned = 0;
+			bool complete = true; //false if the budget ran out, so some matches may be missing
+		};
+
+		//How a new database lays out its points, an existing one keeps the layout it was created with
+		struct layout_options {
+			//the distances from each point to the vantage points in one small blob, rather than an indexed
+			// column each, so inserts write fewer B-trees and the file is smaller
+			bool packed;
+			//the points indexed by partition along with their values, so the points of a partition are read
+			// from contiguous pages, at the cost of a second copy of the values. May be added to an existing database
+			bool clustered;
+		};
 
 		//Open the database
-		Database(const std::string& path);
+		// read only is for queries and checks of an existing database: nothing is written (not even the schema),
+		// and the file is mapped into memory, so it opens fast and any number of processes can query it at once
+		// a new database is created with the given number of shards, files written and queried in parallel:
+		//   path, then path.1, path.2, ... An existing one keeps the shards it was created with, 0 accepts any
+		Database(const std::string& path, bool read_only = false, size_t shards = 0, const layout_options& layout = {});
 
 		//Close the database
 		~Database();
 
+		//Scan the partitions covered by a query with n threads at once, each on a read-only connection of its own
+		// they only see what's committed, which in WAL mode (as the database is opened, unless read only) doesn't wait for a writer
+		void set_query_threads(size_t n);
+
 		//check that the database was created with the given hash type
 		// if no hash type is in the database, (ie. first use) then sets the hash type
-		bool check_hash_type(const std::string& hash_type_str);
+		// if allow_prefix, also accepts a DCT type whose hashes are prefixes of the database's (e.g. DCT8E for DCT32E)
+		//   queries then compare only the prefix, and inserts are rejected
+		bool check_hash_type(const std::string& hash_type_str, bool allow_prefix = false);
 
 		//Add a file
 		void insert(const point_type& point, const item_type& item);
 
+		//Add a file, with its info
+		void insert(const entry& e);
+
+		//Add a group of files in one transaction
+		// the vantage points are balanced once for the whole group, rather than after each file
+		void insert(const std::vector<entry>& entries);
+
+		//The info of each file that was added with it, for skipping the files that haven't changed since
+		std::unordered_map<item_type, file_info> file_infos();
+
+		//The hash of each file digest that was added with it, for reusing the hash of a byte-identical file
+		// none if the database is queried with a prefix of its hash type (see check_hash_type)
+		std::vector<std::pair<Digest, point_type>> digests();
+
+		//Rename an image. If the new name belongs in another shard, the image is added to that shard (with its file info
+		// and digest), then removed from its own, which is undone if the removal fails. If the process stops between the
+		// two, the image is in both shards, under both names, and renaming it again finishes the move
 		void rename(const item_type& item1, const item_type& item2);
 		void remove(const item_type& item);
 		bool exists(const item_type& item);
 
+		//Remove the points no image refers to any more (left by remove and by replacing an image's points),
+		// rebalance the vantage points, picking new ones for those that no longer split the points,
+		// then rebuild the indexes and the files
+		// with a time budget, stops once it runs out, and returns false: calling it again carries on where it stopped
+		//   each step is a transaction of its own, so the database can be used between them. Rebuilding the indexes and
+		//   files are single steps, which may overrun the budget
+		// returns true once done
+		bool compact(std::chrono::milliseconds budget = std::chrono::milliseconds(0));
+
 		//Find similar items
 		std::vector<query_result> query(const point_type& point, unsigned int dist, size_t limit = 10);
+
+		//Find similar items, passing each to callback in order of distance as soon as it is confirmed
+		//   (with shards, once every shard has been queried)
+		// with a budget, the query is approximate and stops when the budget runs out (in each shard)
+		query_stats query(const point_type& point, unsigned int dist, size_t limit, const std::function<query_fn>& callback,
+			const query_budget& budget = {});
+
+		//Find similar items for each of the points, sharing the partition scans between them
+		std::vector<std::vector<query_result>> query_batch(const std::vector<point_type>& points, unsigned int dist, size_t limit = 10);
+	};
+
+	//Adds files to a database on a thread of its own, committing them in groups
+	// the writer owns the database while it runs: nothing else may use it until finish()
+	class DatabaseWriter {
+	public:
+		using done_fn = void (const Database::point_type& point, const Database::item_type& item);
+
+		//A group is committed when it has group_size files, or group_time after its first file arrived
+		// done is called (on the writer thread) for each file once its group is committed, in the order they were pushed
+		DatabaseWriter(Database& db, std::function<done_fn> done = nullptr, size_t group_size = 256,
+			std::chrono::milliseconds group_time = std::chrono::milliseconds(1000));
+
+		//Commit whatever is queued and stop, ignoring any error
+		~DatabaseWriter();
+
+		DatabaseWriter(const DatabaseWriter&) = delete;
+		DatabaseWriter& operator=(const DatabaseWriter&) = delete;
+
+		//Queue a file to add, waiting if the queue is full
+		// rethrows the error if a group failed to commit
+		void push(Database::point_type point, Database::item_type item);
+		void push(Database::entry e);
+
+		//Commit whatever is queued and stop
+		// rethrows the error if a group failed to commit
+		void finish();
+
+	private:
+		void run();
+		void check_error();
+
+		Database& db;
+		std::function<done_fn> done;
+		size_t group_size;
+		std::chrono::milliseconds group_time;
+
+		std::mutex mutex;
+		std::condition_variable cv_push, cv_pop;
+		std::deque<Database::entry> queue;
+		bool closed;
+		std::exception_ptr error;
+
+		std::thread thread;
 	};
 }
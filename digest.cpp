@@ -0,0 +1,119 @@
+#include "digest.h"
+
+#include <cstring>
+
+namespace imghash {
+
+	namespace {
+		//MurmurHash3_x64_128, by Austin Appleby, who placed it in the public domain
+		inline uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+		inline uint64_t fmix(uint64_t k)
+		{
+			k ^= k >> 33;
+			k *= 0xff51afd7ed558ccdULL;
+			k ^= k >> 33;
+			k *= 0xc4ceb9fe1a85ec53ULL;
+			k ^= k >> 33;
+			return k;
+		}
+
+		inline uint64_t load_le(const uint8_t* p)
+		{
+			uint64_t v = 0;
+			for (int i = 7; i >= 0; --i) v = (v << 8) | p[i];
+			return v;
+		}
+
+		const uint64_t c1 = 0x87c37b91114253d5ULL;
+		const uint64_t c2 = 0x4cf5ad432745937fULL;
+	}
+
+	void Digest::to_bytes(uint8_t* out) const
+	{
+		for (int i = 0; i < 8; ++i) {
+			out[i] = static_cast<uint8_t>(h1 >> (8 * i));
+			out[8 + i] = static_cast<uint8_t>(h2 >> (8 * i));
+		}
+	}
+
+	Digest Digest::from_bytes(const uint8_t* bytes)
+	{
+		Digest d;
+		d.h1 = load_le(bytes);
+		d.h2 = load_le(bytes + 8);
+		return d;
+	}
+
+	Digest digest(const uint8_t* data, size_t size)
+	{
+		uint64_t h1 = 0, h2 = 0;
+
+		//body, 16 bytes at a time
+		const size_t nblocks = size / 16;
+		for (size_t i = 0; i < nblocks; ++i) {
+			uint64_t k1, k2;
+			std::memcpy(&k1, data + 16 * i, 8);
+			std::memcpy(&k2, data + 16 * i + 8, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+			k1 = load_le(data + 16 * i);
+			k2 = load_le(data + 16 * i + 8);
+#endif
+			k1 *= c1; k1 = rotl(k1, 31); k1 *= c2; h1 ^= k1;
+			h1 = rotl(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+			k2 *= c2; k2 = rotl(k2, 33); k2 *= c1; h2 ^= k2;
+			h2 = rotl(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+		}
+
+		//tail
+		const uint8_t* tail = data + nblocks * 16;
+		uint64_t k1 = 0, k2 = 0;
+		switch (size & 15) {
+		case 15: k2 ^= static_cast<uint64_t>(tail[14]) << 48; [[fallthrough]];
+		case 14: k2 ^= static_cast<uint64_t>(tail[13]) << 40; [[fallthrough]];
+		case 13: k2 ^= static_cast<uint64_t>(tail[12]) << 32; [[fallthrough]];
+		case 12: k2 ^= static_cast<uint64_t>(tail[11]) << 24; [[fallthrough]];
+		case 11: k2 ^= static_cast<uint64_t>(tail[10]) << 16; [[fallthrough]];
+		case 10: k2 ^= static_cast<uint64_t>(tail[9]) << 8; [[fallthrough]];
+		case 9: k2 ^= static_cast<uint64_t>(tail[8]);
+			k2 *= c2; k2 = rotl(k2, 33); k2 *= c1; h2 ^= k2;
+			[[fallthrough]];
+		case 8: k1 ^= static_cast<uint64_t>(tail[7]) << 56; [[fallthrough]];
+		case 7: k1 ^= static_cast<uint64_t>(tail[6]) << 48; [[fallthrough]];
+		case 6: k1 ^= static_cast<uint64_t>(tail[5]) << 40; [[fallthrough]];
+		case 5: k1 ^= static_cast<uint64_t>(tail[4]) << 32; [[fallthrough]];
+		case 4: k1 ^= static_cast<uint64_t>(tail[3]) << 24; [[fallthrough]];
+		case 3: k1 ^= static_cast<uint64_t>(tail[2]) << 16; [[fallthrough]];
+		case 2: k1 ^= static_cast<uint64_t>(tail[1]) << 8; [[fallthrough]];
+		case 1: k1 ^= static_cast<uint64_t>(tail[0]);
+			k1 *= c1; k1 = rotl(k1, 31); k1 *= c2; h1 ^= k1;
+		}
+
+		//finalization
+		h1 ^= size; h2 ^= size;
+		h1 += h2; h2 += h1;
+		h1 = fmix(h1); h2 = fmix(h2);
+		h1 += h2; h2 += h1;
+
+		Digest d;
+		d.h1 = h1;
+		d.h2 = h2;
+		return d;
+	}
+
+	bool DigestTable::find(const Digest& d, std::vector<uint8_t>& hash)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto h = hashes.find(d);
+		if (h == hashes.end()) return false;
+		hash = h->second;
+		return true;
+	}
+
+	void DigestTable::insert(const Digest& d, const std::vector<uint8_t>& hash)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		hashes.emplace(d, hash);
+	}
+
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <cstdint>
+#include <cstddef>
+
+namespace imghash {
+
+	//! A 128-bit digest of a file's bytes, for spotting byte-identical files without decoding them
+	/*!
+	Not cryptographic: it's MurmurHash3 (x64, 128-bit), which runs at memory speed, so digesting a file
+	costs next to nothing beside decoding it.
+	*/
+	struct Digest {
+		uint64_t h1 = 0, h2 = 0;
+
+		static constexpr size_t size = 16;
+
+		bool operator==(const Digest& other) const { return h1 == other.h1 && h2 == other.h2; }
+		bool operator!=(const Digest& other) const { return !(*this == other); }
+
+		//! The digest as 16 bytes, little endian, for storing
+		void to_bytes(uint8_t* out) const;
+		static Digest from_bytes(const uint8_t* bytes);
+
+		struct hasher {
+			size_t operator()(const Digest& d) const { return static_cast<size_t>(d.h1); }
+		};
+	};
+
+	//! Digest size bytes of data
+	Digest digest(const uint8_t* data, size_t size);
+
+	//! Perceptual hashes by the digest of the file they were computed from, shared between threads
+	class DigestTable
+	{
+		std::mutex mutex;
+		std::unordered_map<Digest, std::vector<uint8_t>, Digest::hasher> hashes;
+	public:
+		//! Get the hash of a file with this digest, returns false if there isn't one
+		bool find(const Digest& d, std::vector<uint8_t>& hash);
+
+		void insert(const Digest& d, const std::vector<uint8_t>& hash);
+	};
+
+}
@@ -0,0 +1,565 @@
+#include "filereader.h"
+#include "threadpool.h"
+
+#include <stdexcept>
+#include <algorithm>
+#include <map>
+#include <cstring>
+
+#ifdef _WIN32
+#include <cstdio>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <cerrno>
+#endif
+
+namespace imghash {
+
+	FileReader::FileReader(size_t max_files, size_t max_bytes)
+		: max_files(max_files > 0 ? max_files : 1), max_bytes(max_bytes), files_held(0), bytes_held(0), releases(0), stop(false)
+	{
+		//nothing else to do
+	}
+
+	void FileReader::release(size_t index)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (files_held > 0) --files_held;
+			auto h = held.find(index);
+			if (h != held.end()) {
+				bytes_held -= h->second;
+				held.erase(h);
+			}
+			++releases;
+		}
+		cv.notify_all();
+	}
+
+	void FileReader::cancel()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop = true;
+		}
+		cv.notify_all();
+	}
+
+	bool FileReader::acquire_slot()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		cv.wait(lock, [&] { return stop || files_held < max_files; });
+		if (stop) return false;
+		++files_held;
+		return true;
+	}
+
+	bool FileReader::acquire_bytes(size_t index, size_t bytes)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		cv.wait(lock, [&] { return stop || fits(bytes); });
+		if (stop) return false;
+		bytes_held += bytes;
+		held[index] = bytes;
+		return true;
+	}
+
+	bool FileReader::try_acquire_slot()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (stop || files_held >= max_files) return false;
+		++files_held;
+		return true;
+	}
+
+	bool FileReader::try_acquire_bytes(size_t index, size_t bytes)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (stop || !fits(bytes)) return false;
+		bytes_held += bytes;
+		held[index] = bytes;
+		return true;
+	}
+
+	size_t FileReader::release_count()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return releases;
+	}
+
+	void FileReader::wait_release(size_t seen)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		cv.wait(lock, [&] { return stop || releases != seen; });
+	}
+
+	bool FileReader::cancelled()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return stop;
+	}
+
+	namespace {
+
+		//! Reads each file with pread, on a pool of threads
+		class PreadFileReader : public FileReader
+		{
+			ThreadPool pool;
+
+			static size_t file_size(const std::string& path);
+			static void read_file(const std::string& path, std::vector<uint8_t>& data);
+		public:
+			PreadFileReader(size_t max_files, size_t max_bytes, size_t threads)
+				: FileReader(max_files, max_bytes), pool(threads)
+			{
+				//nothing else to do
+			}
+
+			void read(const std::function<next_fn>& next, const std::function<done_fn>& done) override
+			{
+				//the bytes are taken in order, so the caller can always release the file it's waiting for
+				std::exception_ptr next_error;
+				std::string path;
+				bool read_path = true;
+				try {
+					for (size_t i = 0; next(path, read_path); ++i, read_path = true) {
+						if (!acquire_slot()) break;
+						if (!read_path) {
+							done(i, path, std::vector<uint8_t>(), nullptr);
+							continue;
+						}
+						if (!acquire_bytes(i, file_size(path))) break;
+						pool.submit([&, i, path]() {
+							std::vector<uint8_t> data;
+							std::exception_ptr error;
+							try {
+								read_file(path, data);
+							}
+							catch (...) {
+								error = std::current_exception();
+								data.clear();
+							}
+							done(i, path, std::move(data), error);
+						});
+					}
+				}
+				catch (...) {
+					next_error = std::current_exception();
+				}
+				pool.wait();
+				if (next_error) std::rethrow_exception(next_error);
+			}
+		};
+
+		size_t PreadFileReader::file_size(const std::string& path)
+		{
+			//0 for anything but a regular file, as its size isn't known until it's read
+#ifdef _WIN32
+			struct _stat64 st;
+			if (_stat64(path.c_str(), &st) != 0 || !(st.st_mode & _S_IFREG)) return 0;
+#else
+			struct stat st;
+			if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) return 0;
+#endif
+			return static_cast<size_t>(st.st_size);
+		}
+
+		void PreadFileReader::read_file(const std::string& path, std::vector<uint8_t>& data)
+		{
+#ifdef _WIN32
+			FILE* file = fopen(path.c_str(), "rb");
+			if (file == nullptr) {
+				throw std::runtime_error("Failed to open file");
+			}
+			fseek(file, 0, SEEK_END);
+			long size = ftell(file);
+			fseek(file, 0, SEEK_SET);
+			if (size < 0) {
+				fclose(file);
+				throw std::runtime_error("Failed to read file");
+			}
+			data.resize(static_cast<size_t>(size));
+			data.resize(fread(data.data(), 1, data.size(), file));
+			fclose(file);
+#else
+			int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+			if (fd < 0) {
+				throw std::runtime_error("Failed to open file");
+			}
+			//the size of anything but a regular file isn't known until it's read
+			struct stat st;
+			bool regular = (fstat(fd, &st) == 0) && S_ISREG(st.st_mode);
+			data.resize(regular ? static_cast<size_t>(st.st_size) : 0x10000);
+			size_t offset = 0;
+			while (true) {
+				if (!regular && offset == data.size()) data.resize(2 * data.size());
+				if (offset == data.size()) break;
+				ssize_t n = pread(fd, data.data() + offset, data.size() - offset, static_cast<off_t>(offset));
+				if (n < 0) {
+					close(fd);
+					throw std::runtime_error("Failed to read file");
+				}
+				if (n == 0) break;
+				offset += static_cast<size_t>(n);
+			}
+			data.resize(offset);
+			close(fd);
+#endif
+		}
+
+#ifdef __linux__
+		//! Reads files with chains of io_uring requests (statx, openat, read, close) on one thread
+		/*!
+		The ring is driven with the raw system calls, so there's no dependency on liburing.
+		*/
+		class UringFileReader : public FileReader
+		{
+			int ring_fd;
+			unsigned entries;
+
+			void* sq_ptr; size_t sq_size;
+			void* cq_ptr; size_t cq_size;
+			io_uring_sqe* sqes; size_t sqes_size;
+			unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+			unsigned *cq_head, *cq_tail, *cq_mask;
+			io_uring_cqe* cqes;
+
+			unsigned to_submit;
+
+			//a file being read, and the request it's waiting on
+			struct file_op {
+				enum { STATX, OPEN, READ, CLOSE } stage;
+				size_t index;
+				std::string path;
+				bool read = true;
+				int fd = -1;
+				struct statx stx;
+				bool regular = false;
+				std::vector<uint8_t> data;
+				size_t offset = 0;
+				std::exception_ptr error;
+			};
+
+			bool init();
+			io_uring_sqe* get_sqe(file_op* op);
+			void queue_read(file_op* op);
+			void queue_close(file_op* op);
+		public:
+			UringFileReader(size_t max_files, size_t max_bytes)
+				: FileReader(std::min<size_t>(max_files, 4096), max_bytes),
+				ring_fd(-1), entries(static_cast<unsigned>(std::min<size_t>(std::max<size_t>(max_files, 1), 4096))),
+				sq_ptr(MAP_FAILED), sq_size(0), cq_ptr(MAP_FAILED), cq_size(0), sqes(nullptr), sqes_size(0),
+				to_submit(0)
+			{
+				//each file has at most one request in the ring, so `entries` is enough for every file held
+			}
+
+			~UringFileReader()
+			{
+				if (sqes) munmap(sqes, sqes_size);
+				if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) munmap(cq_ptr, cq_size);
+				if (sq_ptr != MAP_FAILED) munmap(sq_ptr, sq_size);
+				if (ring_fd >= 0) close(ring_fd);
+			}
+
+			//! nullptr if io_uring, or one of the requests used, isn't available
+			static std::unique_ptr<UringFileReader> create(size_t max_files, size_t max_bytes)
+			{
+				auto reader = std::make_unique<UringFileReader>(max_files, max_bytes);
+				if (!reader->init()) return nullptr;
+				return reader;
+			}
+
+			void read(const std::function<next_fn>& next, const std::function<done_fn>& done) override;
+		};
+
+		bool UringFileReader::init()
+		{
+			io_uring_params params;
+			std::memset(&params, 0, sizeof(params));
+			ring_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+			if (ring_fd < 0) return false;
+
+			//check that the kernel supports the requests we need (5.6+)
+			const unsigned num_ops = 256;
+			std::vector<uint8_t> probe_buf(sizeof(io_uring_probe) + num_ops * sizeof(io_uring_probe_op), 0);
+			auto probe = reinterpret_cast<io_uring_probe*>(probe_buf.data());
+			if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, num_ops) < 0) return false;
+			for (unsigned op : { IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE }) {
+				if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) return false;
+			}
+
+			//map the rings
+			sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+			cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+			bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+			if (single_mmap) sq_size = cq_size = std::max(sq_size, cq_size);
+			sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+			if (sq_ptr == MAP_FAILED) return false;
+			if (single_mmap) {
+				cq_ptr = sq_ptr;
+			}
+			else {
+				cq_ptr = mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+				if (cq_ptr == MAP_FAILED) return false;
+			}
+			sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+			void* p = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+			if (p == MAP_FAILED) return false;
+			sqes = static_cast<io_uring_sqe*>(p);
+
+			auto sq = static_cast<uint8_t*>(sq_ptr);
+			sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+			sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+			sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+			sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+			auto cq = static_cast<uint8_t*>(cq_ptr);
+			cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+			cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+			cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+			cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+			entries = params.sq_entries;
+			return true;
+		}
+
+		io_uring_sqe* UringFileReader::get_sqe(file_op* op)
+		{
+			//there's always room: each file held has at most one request in the ring
+			unsigned tail = *sq_tail;
+			unsigned index = tail & *sq_mask;
+			io_uring_sqe* sqe = &sqes[index];
+			std::memset(sqe, 0, sizeof(*sqe));
+			sqe->user_data = reinterpret_cast<uint64_t>(op);
+			sq_array[index] = index;
+			__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+			++to_submit;
+			return sqe;
+		}
+
+		void UringFileReader::queue_read(file_op* op)
+		{
+			//grow the buffer for files of unknown size
+			if (!op->regular && op->offset == op->data.size()) {
+				op->data.resize(std::max<size_t>(2 * op->data.size(), 0x10000));
+			}
+			op->stage = file_op::READ;
+			auto sqe = get_sqe(op);
+			sqe->opcode = IORING_OP_READ;
+			sqe->fd = op->fd;
+			sqe->addr = reinterpret_cast<uint64_t>(op->data.data() + op->offset);
+			sqe->len = static_cast<uint32_t>(std::min<size_t>(op->data.size() - op->offset, 0x40000000));
+			sqe->off = op->offset;
+		}
+
+		void UringFileReader::queue_close(file_op* op)
+		{
+			op->stage = file_op::CLOSE;
+			auto sqe = get_sqe(op);
+			sqe->opcode = IORING_OP_CLOSE;
+			sqe->fd = op->fd;
+		}
+
+		void UringFileReader::read(const std::function<next_fn>& next, const std::function<done_fn>& done)
+		{
+			std::unordered_map<file_op*, std::unique_ptr<file_op>> live;
+			//statx done, waiting for the bytes to read into. They're taken in order, as in the pread reader
+			std::map<size_t, file_op*> waiting;
+			size_t started = 0; // the index of the next file to start
+			size_t next_bytes = 0; // the next file to take bytes
+			size_t in_ring = 0;
+			//the next path, got before there's a slot for it
+			std::string path;
+			bool read_path = true, have_path = false, more = true;
+			std::exception_ptr next_error, done_error;
+
+			//an error thrown by done can't unwind through here while the kernel still holds requests into live's
+			// buffers, so it's kept, no more files are started or passed to done, and it's thrown once the ring is empty
+			auto call_done = [&](size_t index, const std::string& path, std::vector<uint8_t> data, std::exception_ptr error) {
+				if (done_error) return;
+				try {
+					done(index, path, std::move(data), error);
+				}
+				catch (...) {
+					done_error = std::current_exception();
+				}
+			};
+			auto finish = [&](file_op* op) {
+				if (op->error) op->data.clear();
+				else op->data.resize(op->offset);
+				call_done(op->index, op->path, std::move(op->data), op->error);
+				live.erase(op);
+			};
+			auto fail = [&](file_op* op, const char* message) {
+				if (!op->error) op->error = std::make_exception_ptr(std::runtime_error(message));
+				if (op->fd >= 0) {
+					queue_close(op);
+					++in_ring;
+				}
+				else {
+					finish(op);
+				}
+			};
+
+			while (true) {
+				size_t seen = release_count();
+				bool stopping = cancelled() || done_error;
+
+				//start new files while there are free slots
+				while (!stopping && more) {
+					if (!have_path) {
+						try {
+							read_path = true;
+							have_path = more = next(path, read_path);
+						}
+						catch (...) {
+							//finish the files in flight, then throw
+							next_error = std::current_exception();
+							more = false;
+						}
+						if (!more) break;
+					}
+					if (!try_acquire_slot()) break;
+					auto op = std::make_unique<file_op>();
+					op->stage = file_op::STATX;
+					op->index = started++;
+					op->path = std::move(path);
+					op->read = read_path;
+					have_path = false;
+					if (!op->read) {
+						//no statx: it just waits for its turn
+						waiting.emplace(op->index, op.get());
+						live.emplace(op.get(), std::move(op));
+						continue;
+					}
+					auto sqe = get_sqe(op.get());
+					sqe->opcode = IORING_OP_STATX;
+					sqe->fd = AT_FDCWD;
+					sqe->addr = reinterpret_cast<uint64_t>(op->path.c_str());
+					sqe->len = STATX_TYPE | STATX_SIZE;
+					sqe->addr2 = reinterpret_cast<uint64_t>(&op->stx);
+					++in_ring;
+					live.emplace(op.get(), std::move(op));
+				}
+
+				//open the files there are now bytes for, in order
+				while (!waiting.empty() && (stopping || waiting.begin()->first == next_bytes)) {
+					file_op* op = waiting.begin()->second;
+					if (stopping || op->error) {
+						waiting.erase(waiting.begin());
+						++next_bytes;
+						fail(op, "Failed to read file");
+						continue;
+					}
+					if (!op->read) {
+						waiting.erase(waiting.begin());
+						++next_bytes;
+						finish(op);
+						continue;
+					}
+					size_t size = op->regular ? static_cast<size_t>(op->stx.stx_size) : 0;
+					if (!try_acquire_bytes(op->index, size)) break;
+					waiting.erase(waiting.begin());
+					++next_bytes;
+					op->data.resize(size);
+					op->stage = file_op::OPEN;
+					auto sqe = get_sqe(op);
+					sqe->opcode = IORING_OP_OPENAT;
+					sqe->fd = AT_FDCWD;
+					sqe->addr = reinterpret_cast<uint64_t>(op->path.c_str());
+					sqe->open_flags = O_RDONLY | O_CLOEXEC;
+					++in_ring;
+				}
+
+				if (live.empty() && (stopping || !more)) break;
+
+				if (in_ring == 0) {
+					//everything is waiting on the caller to release files
+					wait_release(seen);
+					continue;
+				}
+
+				//submit, and wait for at least one completion
+				int ret = static_cast<int>(syscall(__NR_io_uring_enter, ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS, nullptr, 0));
+				if (ret < 0) {
+					if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+					//the ring is unusable: fail the files in flight, leaving their buffers to the kernel
+					auto error = std::make_exception_ptr(std::runtime_error("io_uring_enter failed"));
+					for (auto& l : live) {
+						call_done(l.first->index, l.first->path, std::vector<uint8_t>(), error);
+						l.second.release();
+					}
+					if (done_error) std::rethrow_exception(done_error);
+					std::rethrow_exception(error);
+				}
+				to_submit -= std::min<unsigned>(to_submit, static_cast<unsigned>(ret));
+
+				unsigned head = *cq_head;
+				unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+				for (; head != tail; ++head) {
+					const io_uring_cqe& cqe = cqes[head & *cq_mask];
+					file_op* op = reinterpret_cast<file_op*>(cqe.user_data);
+					int res = cqe.res;
+					--in_ring;
+
+					switch (op->stage) {
+					case file_op::STATX:
+						//the size of anything but a regular file isn't known until it's read
+						if (res < 0) op->error = std::make_exception_ptr(std::runtime_error("Failed to open file"));
+						else op->regular = S_ISREG(op->stx.stx_mode);
+						waiting.emplace(op->index, op);
+						break;
+					case file_op::OPEN:
+						if (res < 0) {
+							fail(op, "Failed to open file");
+							break;
+						}
+						op->fd = res;
+						if (op->regular && op->data.empty()) queue_close(op);
+						else queue_read(op);
+						++in_ring;
+						break;
+					case file_op::READ:
+						if (res == -EINTR || res == -EAGAIN) {
+							queue_read(op);
+							++in_ring;
+							break;
+						}
+						if (res < 0) {
+							fail(op, "Failed to read file");
+							break;
+						}
+						op->offset += static_cast<size_t>(res);
+						if (res == 0 || (op->regular && op->offset >= op->data.size())) queue_close(op);
+						else queue_read(op);
+						++in_ring;
+						break;
+					case file_op::CLOSE:
+						finish(op);
+						break;
+					}
+				}
+				__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+			}
+			if (done_error) std::rethrow_exception(done_error);
+			if (next_error) std::rethrow_exception(next_error);
+		}
+#endif
+	}
+
+	std::unique_ptr<FileReader> FileReader::create(size_t max_files, size_t max_bytes, size_t threads)
+	{
+#ifdef __linux__
+		if (auto reader = UringFileReader::create(max_files, max_bytes)) return reader;
+#endif
+		return std::make_unique<PreadFileReader>(max_files, max_bytes, threads);
+	}
+
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <cstdint>
+#include <unordered_map>
+
+namespace imghash {
+
+	//! Reads whole files into memory, keeping many reads in flight
+	/*!
+	For when opening and reading files, rather than decoding them, is the bottleneck (e.g. many small files on
+	network or cold storage). On Linux the opens and reads are queued on an io_uring, so a single thread keeps
+	many files in flight. Elsewhere, or if io_uring isn't available, each file is read with pread on a pool of
+	threads.
+
+	A file holds a slot, and its size in bytes, from when it's started until the caller releases it, so at most
+	max_files files and max_bytes bytes are held at once (a file bigger than max_bytes is still read, on its own).
+	Files are started, and take their bytes, in order, so if the caller releases them in order too, every file
+	held is within max_files of the oldest, and the file the caller is waiting for is never stuck behind later ones.
+	*/
+	class FileReader
+	{
+	public:
+		//! Gets the path of the next file to read. Returns false at the end
+		/*!
+		read is true on entry. Set it to false for a file that needn't be read (e.g. its hash is cached):
+		it still takes its place in order, and done is called for it with no data
+		*/
+		using next_fn = bool (std::string& path, bool& read);
+
+		//! Called as each file is read, in no particular order, possibly from several threads at once
+		/*!
+		Files are indexed from 0, in the order next gave them. On error data is empty and error is set
+		*/
+		using done_fn = void (size_t index, const std::string& path, std::vector<uint8_t>&& data, std::exception_ptr error);
+
+		//! The io_uring reader where it's available, otherwise a pread reader with `threads` threads
+		static std::unique_ptr<FileReader> create(size_t max_files, size_t max_bytes, size_t threads);
+
+		virtual ~FileReader() {}
+
+		//! Read the files that next gives, calling done for each. Returns when they have all been read, or on cancel()
+		/*!
+		Paths are only asked for as there's room for them. Every file started gets its call to done before read
+		returns, even if it throws (e.g. if next throws, the files in flight are finished before it's rethrown)
+		*/
+		virtual void read(const std::function<next_fn>& next, const std::function<done_fn>& done) = 0;
+
+		//! Give back the slot and bytes held by the file with this index, once the caller is finished with it
+		void release(size_t index);
+
+		//! Stop starting files. read() returns once the files in flight are done
+		void cancel();
+
+	protected:
+		FileReader(size_t max_files, size_t max_bytes);
+
+		//take a slot, or the bytes for the file with this index, waiting until they're free. Return false if cancelled
+		bool acquire_slot();
+		bool acquire_bytes(size_t index, size_t bytes);
+		//take a slot, or the bytes, if they're free
+		bool try_acquire_slot();
+		bool try_acquire_bytes(size_t index, size_t bytes);
+		//the number of releases so far, and wait until there are more than seen (or until cancelled)
+		size_t release_count();
+		void wait_release(size_t seen);
+		bool cancelled();
+
+	private:
+		bool fits(size_t bytes) const { return bytes_held == 0 || bytes_held + bytes <= max_bytes; }
+
+		std::mutex mutex;
+		std::condition_variable cv;
+		size_t max_files, max_bytes;
+		size_t files_held, bytes_held;
+		std::unordered_map<size_t, size_t> held; // index -> bytes
+		size_t releases;
+		bool stop;
+	};
+
+}
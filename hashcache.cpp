@@ -0,0 +1,320 @@
+#include "hashcache.h"
+#include "digest.h"
+
+#include <stdexcept>
+#include <unordered_set>
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+namespace imghash {
+
+	namespace {
+		//the header, with the format version in its last byte
+		const uint8_t magic[8] = { 'I', 'M', 'G', 'H', 'A', 'S', 'H', 2 };
+
+		//a record is its length and checksum, then the file's size, mtime and inode, then the lengths and bytes of
+		// the path, hash type and hash. Numbers are little endian
+		const size_t record_header = 36;
+		const size_t compact_min_size = 1 << 20;
+		const size_t flush_size = 1 << 20;
+
+		void put(uint8_t* out, uint64_t v, size_t n)
+		{
+			for (size_t i = 0; i < n; ++i) out[i] = static_cast<uint8_t>(v >> (8 * i));
+		}
+
+		uint64_t get(const uint8_t* in, size_t n)
+		{
+			uint64_t v = 0;
+			for (size_t i = n; i > 0; --i) v = (v << 8) | in[i - 1];
+			return v;
+		}
+
+		//the path a file is cached by: absolute, so the same file is found from any working directory
+		std::string cache_key(const std::string& file)
+		{
+			std::error_code ec;
+			auto p = std::filesystem::absolute(file, ec);
+			return ec ? file : p.lexically_normal().string();
+		}
+
+		uint32_t checksum(const uint8_t* record, size_t length)
+		{
+			return static_cast<uint32_t>(digest(record + 8, length - 8).h1);
+		}
+
+		struct key_hash {
+			size_t operator()(const std::pair<std::string_view, std::string_view>& k) const {
+				return std::hash<std::string_view>()(k.first) ^ (std::hash<std::string_view>()(k.second) << 1);
+			}
+		};
+
+#ifndef _WIN32
+		//open the cache file and lock it, making sure it's the one at path now, and not one a compaction replaced
+		int open_locked(const std::string& path, int operation)
+		{
+			while (true) {
+				int fd = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+				if (fd < 0) {
+					throw std::runtime_error("Failed to open cache file");
+				}
+				struct stat st_fd, st_path;
+				if (flock(fd, operation) == 0 && fstat(fd, &st_fd) == 0 && stat(path.c_str(), &st_path) == 0 &&
+					st_fd.st_ino == st_path.st_ino && st_fd.st_dev == st_path.st_dev) {
+					return fd;
+				}
+				close(fd);
+			}
+		}
+
+		bool write_all(int fd, const uint8_t* data, size_t size)
+		{
+			while (size > 0) {
+				ssize_t n = write(fd, data, size);
+				if (n < 0) {
+					if (errno == EINTR) continue;
+					return false;
+				}
+				data += n;
+				size -= static_cast<size_t>(n);
+			}
+			return true;
+		}
+#endif
+	}
+
+	template<class F>
+	size_t HashCache::scan(const uint8_t* data, size_t size, F f)
+	{
+		//stop at the first record that's cut short or doesn't check, e.g. one torn by a crash
+		size_t pos = sizeof(magic);
+		while (pos + record_header <= size) {
+			const uint8_t* r = data + pos;
+			size_t length = static_cast<size_t>(get(r, 4));
+			if (length < record_header || length > size - pos) break;
+			size_t path_len = static_cast<size_t>(get(r + 32, 2));
+			size_t type_len = r[34];
+			size_t hash_len = r[35];
+			if (record_header + path_len + type_len + hash_len != length) break;
+			if (checksum(r, length) != static_cast<uint32_t>(get(r + 4, 4))) break;
+
+			std::string_view file(reinterpret_cast<const char*>(r + record_header), path_len);
+			std::string_view type(reinterpret_cast<const char*>(r + record_header + path_len), type_len);
+			f(file, type, r);
+			pos += length;
+		}
+		return pos;
+	}
+
+	HashCache::HashCache(const std::string& path, const std::string& hash_type)
+		: path(path), hash_type(hash_type), map(nullptr), map_size(0), records(0), live(0), pending_records(0)
+	{
+#ifdef _WIN32
+		throw std::runtime_error("The hash cache is only supported on POSIX systems");
+#else
+		int fd = open_locked(path, LOCK_EX);
+		struct stat st;
+		if (fstat(fd, &st) != 0) {
+			close(fd);
+			throw std::runtime_error("Failed to open cache file");
+		}
+		map_size = static_cast<size_t>(st.st_size);
+		//a cache from an older version of the format is started again, rather than refused
+		uint8_t header[sizeof(magic)];
+		if (map_size >= sizeof(magic) && pread(fd, header, sizeof(magic), 0) == static_cast<ssize_t>(sizeof(magic)) &&
+			std::memcmp(header, magic, sizeof(magic) - 1) == 0 && header[sizeof(magic) - 1] < magic[sizeof(magic) - 1]) {
+			if (ftruncate(fd, 0) != 0) {
+				close(fd);
+				throw std::runtime_error("Failed to write cache file");
+			}
+			map_size = 0;
+		}
+		if (map_size == 0) {
+			if (!write_all(fd, magic, sizeof(magic))) {
+				close(fd);
+				throw std::runtime_error("Failed to write cache file");
+			}
+			map_size = sizeof(magic);
+		}
+		void* p = mmap(nullptr, map_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (p == MAP_FAILED) {
+			close(fd);
+			throw std::runtime_error("Failed to map cache file");
+		}
+		map = static_cast<const uint8_t*>(p);
+		if (map_size < sizeof(magic) || std::memcmp(map, magic, sizeof(magic)) != 0) {
+			munmap(p, map_size);
+			close(fd);
+			throw std::runtime_error("Invalid cache file");
+		}
+
+		//index the newest record for each path, and count those of every hash type, to know when to compact
+		std::unordered_set<std::pair<std::string_view, std::string_view>, key_hash> keys;
+		size_t end = scan(map, map_size, [&](std::string_view file, std::string_view type, const uint8_t* r) {
+			keys.emplace(file, type);
+			if (type == hash_type) index[file] = r;
+			++records;
+		});
+		live = keys.size();
+
+		//cut off a record torn by a crash, so that the records appended after it can be read
+		if (end < map_size && ftruncate(fd, static_cast<off_t>(end)) != 0) {
+			//then the cache is read up to the torn record, as before
+		}
+
+		//the mapping outlives the descriptor
+		flock(fd, LOCK_UN);
+		close(fd);
+#endif
+	}
+
+	HashCache::~HashCache()
+	{
+#ifndef _WIN32
+		try {
+			flush();
+			if (map_size >= compact_min_size && records - live > live) compact();
+		}
+		catch (...) {
+			//it's only a cache
+		}
+		munmap(const_cast<uint8_t*>(map), map_size);
+#endif
+	}
+
+	bool HashCache::find(const std::string& file, const FileInfo& info, std::vector<uint8_t>& hash) const
+	{
+		auto i = index.find(cache_key(file));
+		if (i == index.end()) return false;
+		const uint8_t* r = i->second;
+		//the inode too, as a file copied with its mtime (cp -p, rsync) over another may have the same size
+		if (static_cast<int64_t>(get(r + 8, 8)) != info.size || static_cast<int64_t>(get(r + 16, 8)) != info.mtime
+			|| static_cast<int64_t>(get(r + 24, 8)) != info.inode) return false;
+		size_t path_len = static_cast<size_t>(get(r + 32, 2));
+		const uint8_t* h = r + record_header + path_len + r[34];
+		hash.assign(h, h + r[35]);
+		return true;
+	}
+
+	void HashCache::add(const std::string& name, const FileInfo& info, const std::vector<uint8_t>& hash)
+	{
+		auto file = cache_key(name);
+		//a record that can't be stored is just not cached
+		if (info.size < 0 || file.size() > 0xFFFF || hash_type.size() > 0xFF || hash.size() > 0xFF) return;
+		size_t length = record_header + file.size() + hash_type.size() + hash.size();
+
+		std::unique_lock<std::mutex> lock(mutex);
+		size_t pos = pending.size();
+		pending.resize(pos + length);
+		uint8_t* r = pending.data() + pos;
+		put(r, length, 4);
+		put(r + 8, static_cast<uint64_t>(info.size), 8);
+		put(r + 16, static_cast<uint64_t>(info.mtime), 8);
+		put(r + 24, static_cast<uint64_t>(info.inode), 8);
+		put(r + 32, file.size(), 2);
+		r[34] = static_cast<uint8_t>(hash_type.size());
+		r[35] = static_cast<uint8_t>(hash.size());
+		uint8_t* out = r + record_header;
+		out = std::copy(file.begin(), file.end(), out);
+		out = std::copy(hash_type.begin(), hash_type.end(), out);
+		std::copy(hash.begin(), hash.end(), out);
+		put(r + 4, checksum(r, length), 4);
+		++pending_records;
+		//a path that isn't in the file yet adds a live record, rather than replacing one
+		if (index.find(file) == index.end()) ++live;
+
+		//written a batch at a time, so a long run doesn't hold every record
+		bool full = pending.size() >= flush_size;
+		lock.unlock();
+		if (full) flush();
+	}
+
+	void HashCache::flush()
+	{
+#ifndef _WIN32
+		std::lock_guard<std::mutex> lock(mutex);
+		if (pending.empty()) return;
+
+		//append to whichever file is at path now, in one write, under the lock
+		int out = open_locked(path, LOCK_EX);
+		bool ok = write_all(out, pending.data(), pending.size());
+		flock(out, LOCK_UN);
+		close(out);
+		if (!ok) {
+			throw std::runtime_error("Failed to write cache file");
+		}
+		records += pending_records;
+		pending.clear();
+		pending_records = 0;
+#endif
+	}
+
+	void HashCache::compact()
+	{
+#ifndef _WIN32
+		//read the whole file as it is now, with what other processes have appended, under the lock
+		int in = open_locked(path, LOCK_EX);
+		struct stat st;
+		void* p = MAP_FAILED;
+		size_t size = 0;
+		if (fstat(in, &st) == 0 && st.st_size >= static_cast<off_t>(sizeof(magic))) {
+			size = static_cast<size_t>(st.st_size);
+			p = mmap(nullptr, size, PROT_READ, MAP_SHARED, in, 0);
+		}
+		if (p == MAP_FAILED) {
+			close(in);
+			return;
+		}
+		const uint8_t* data = static_cast<const uint8_t*>(p);
+
+		std::unordered_map<std::pair<std::string_view, std::string_view>, const uint8_t*, key_hash> newest;
+		std::vector<const uint8_t*> order;
+		size_t all = 0;
+		scan(data, size, [&](std::string_view file, std::string_view type, const uint8_t* r) {
+			auto n = newest.emplace(std::make_pair(file, type), r);
+			if (n.second) order.push_back(r);
+			else n.first->second = r;
+			++all;
+		});
+
+		//the counts kept since opening are an estimate (a path added twice, or by another process), so check the file
+		if (all - order.size() <= order.size()) {
+			munmap(p, size);
+			flock(in, LOCK_UN);
+			close(in);
+			return;
+		}
+
+		std::vector<uint8_t> out(magic, magic + sizeof(magic));
+		for (const uint8_t* first : order) {
+			size_t path_len = static_cast<size_t>(get(first + 32, 2));
+			std::string_view file(reinterpret_cast<const char*>(first + record_header), path_len);
+			std::string_view type(reinterpret_cast<const char*>(first + record_header + path_len), first[34]);
+			const uint8_t* r = newest[std::make_pair(file, type)];
+			out.insert(out.end(), r, r + get(r, 4));
+		}
+		munmap(p, size);
+
+		//processes waiting on the lock find that the file at path has changed, and open the new one
+		std::string tmp = path + ".tmp" + std::to_string(getpid());
+		int fd_tmp = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		bool ok = fd_tmp >= 0 && write_all(fd_tmp, out.data(), out.size());
+		if (fd_tmp >= 0) close(fd_tmp);
+		if (ok) ok = rename(tmp.c_str(), path.c_str()) == 0;
+		if (!ok) unlink(tmp.c_str());
+		flock(in, LOCK_UN);
+		close(in);
+#endif
+	}
+
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "input.h"
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <cstdint>
+
+namespace imghash {
+
+	//! A file of hashes by path, so that files that haven't changed aren't hashed again, without a database
+	/*!
+	Entries are keyed by the absolute path and the hash type (Hasher::get_type), and hold the file's size,
+	modification time and inode when it was hashed, so a changed or replaced file misses.
+
+	The file is a header followed by records, only ever appended to. It's mapped into memory and indexed
+	once, when opened, so a lookup is a hash table probe. Each record carries a checksum, so a record torn
+	by a crash is ignored, and records are appended under an exclusive lock, so several processes can share
+	the cache. A later record for a path replaces the earlier ones, and when replaced records outnumber
+	live ones the file is compacted: the live records are written to a new file, which is renamed over the
+	old one. POSIX only.
+	*/
+	class HashCache
+	{
+	public:
+		//! Open the cache file, creating it if it doesn't exist. Throws if it isn't a cache file
+		HashCache(const std::string& path, const std::string& hash_type);
+
+		//! Write the hashes added, and compact the file if it's mostly replaced records, ignoring any error
+		~HashCache();
+
+		HashCache(const HashCache&) = delete;
+		HashCache& operator=(const HashCache&) = delete;
+
+		//! Get the hash of a file, if it was cached with the same info. May be called from any thread
+		bool find(const std::string& file, const FileInfo& info, std::vector<uint8_t>& hash) const;
+
+		//! Cache the hash of a file, written to the file by the next flush (or once enough are added). May be called from any thread
+		void add(const std::string& file, const FileInfo& info, const std::vector<uint8_t>& hash);
+
+		//! Append the hashes added since the last flush to the file
+		void flush();
+
+	private:
+		//the records in [data, data + size), calling f(path, type, record) for each valid one
+		// returns the end of the last valid record
+		template<class F>
+		static size_t scan(const uint8_t* data, size_t size, F f);
+		//write the live records of the file to a new one, and rename it over the file
+		void compact();
+
+		std::string path;
+		std::string hash_type;
+		const uint8_t* map;
+		size_t map_size;
+		//the newest record for each path, of this hash type
+		std::unordered_map<std::string_view, const uint8_t*> index;
+		size_t records; // all records, of any hash type
+		size_t live; // records that haven't been replaced, counting the new paths added
+
+		std::mutex mutex;
+		std::vector<uint8_t> pending; // records added, not yet written
+		size_t pending_records;
+	};
+
+}
@@ -8,6 +8,11 @@
 #include <cstdio>
 #include <bitset>
 #include <algorithm>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#endif
 
 #ifdef max
 #undef max
@@ -63,46 +68,76 @@ namespace imghash {
 
 	Image<float> load(const std::string& fname, Preprocess& prep)
 	{
+		//decoders read straight from the page cache where the file can be mapped
+		MappedFile map(fname);
+		if (map.data()) {
+			Input input(map.data(), map.size());
+			return load(input, prep);
+		}
+
 		FILE* file = fopen(fname.c_str(), "rb");
 		if (file == nullptr) {
 			throw std::runtime_error("Failed to open file");
 		}
 		try {
-			Image<float> img;
-			if (test_ppm(file)) {
-				img = load_ppm(file, prep);
-			}
-		#ifdef USE_JPEG
-			else if (test_jpeg(file)) {
-				img = load_jpeg(file, prep);
-			}
-		#endif
-		#ifdef USE_PNG
-			else if (test_png(file)) {
-				img = load_png(file, prep);
-			}
-		#endif
-			else {
-				throw std::runtime_error("Unsupported file format");
-			}
+			Input input(file);
+			Image<float> img = load(input, prep);
 			fclose(file);
 			return img;
 		}
-		catch (std::exception& e) {
+		catch (...) {
 			fclose(file);
-			throw e;
+			throw;
 		}
 	}
 
-	bool test_ppm(FILE* file) {
-		unsigned char magic[2] = { 0 };
-		auto off = ftell(file);
-		size_t n = fread(magic, sizeof(unsigned char), 2, file);
-		fseek(file, off, SEEK_SET);
-		return (n == 2) && (magic[0] == 'P') && (magic[1] == '6');
+	Image<float> load(Input& input, Preprocess& prep)
+	{
+		if (test_ppm(input)) {
+			return load_ppm(input, prep);
+		}
+	#ifdef USE_JPEG
+		else if (test_jpeg(input)) {
+			return load_jpeg(input, prep);
+		}
+	#endif
+	#ifdef USE_PNG
+		else if (test_png(input)) {
+			return load_png(input, prep);
+		}
+	#endif
+		else {
+			throw std::runtime_error("Unsupported file format");
+		}
 	}
 
-	Image<float> load_ppm(FILE* file, Preprocess& prep, bool empty_error)
+	void load_msb_first(const uint8_t* data, size_t n, uint16_t* out)
+	{
+		std::memcpy(out, data, 2 * n);
+		const uint16_t one = 1;
+		if (*reinterpret_cast<const uint8_t*>(&one) == 0) return; //big-endian, nothing to swap
+
+		size_t i = 0;
+	#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+		//8 samples at a time
+		for (; i + 8 <= n; i += 8) {
+			__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(out + i));
+			v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), v);
+		}
+	#endif
+		for (; i < n; ++i) {
+			out[i] = static_cast<uint16_t>((out[i] << 8) | (out[i] >> 8));
+		}
+	}
+
+	bool test_ppm(Input& input) {
+		const uint8_t* magic;
+		size_t n = input.peek(magic, 2);
+		return (n == 2) && (magic[0] == 'P') && (magic[1] == '6' || magic[1] == '5');
+	}
+
+	bool read_ppm_header(Input& input, PPMHeader& header, bool empty_error)
 	{
 		
 		// 1. Magic number
@@ -123,7 +158,7 @@ namespace imghash {
 		auto parse_space = [&](int c) {
 			bool comment = ((char)c == '#');
 			while (isspace(c) || (comment && c != EOF)) {
-				c = fgetc(file);
+				c = input.get();
 				if (comment) {
 					if ((char)c == '\r' || (char)c == '\n') comment = false;
 				}
@@ -143,7 +178,7 @@ namespace imghash {
 				if (i >= bufsize - 1) {
 					throw std::runtime_error("PPM: Buffer overflow");
 				}
-				c = fgetc(file);
+				c = input.get();
 			}
 			if (c == EOF) {
 				throw std::runtime_error("PPM: Unexpected EOF");
@@ -155,42 +190,40 @@ namespace imghash {
 		};
 				
 		//1. Magic number
-		if (fread(buffer, sizeof(char), 2, file) == 0) {
+		if (input.read(buffer, 2) == 0) {
 			//empty file / end of stream
 			if (empty_error) throw std::runtime_error("PPM: Empty file");
-			else return Image<float>();
+			else return false;
 		}
 		
-		if (buffer[0] != 'P' || buffer[1] != '6') {
+		if (buffer[0] != 'P' || (buffer[1] != '6' && buffer[1] != '5')) {
 			throw std::runtime_error(std::string("PPM: Invalid file (") + buffer + ")");
 		}
+		header.channels = (buffer[1] == '6') ? 3 : 1;
 
 		// 2. Whitespace or comment
-		int c = fgetc(file);
+		int c = input.get();
 		c = parse_space(c);
 		
 		// 3. Width, ASCII decimal
-		size_t width = 0;
-		c = parse_size(c, width);
+		c = parse_size(c, header.width);
 		
 		// 4. Whitespace
 		c = parse_space(c);
 		
 		// 5. Height, ASCII decimal
-		size_t height = 0;
-		c = parse_size(c, height);
+		c = parse_size(c, header.height);
 		
 		// 6. Whitespace
 		c = parse_space(c);
 		
 		// 7. Maxval, ASCII decimal
-		size_t maxval = 0;
-		c = parse_size(c, maxval);
+		c = parse_size(c, header.maxval);
 		
 		//any final comment
 		bool comment = ((char)c == '#');
 		while (comment && c != EOF) {
-			c = fgetc(file);
+			c = input.get();
 			if (c == '\r' || c == '\n') comment = false;
 		}
 		if (c == EOF) {
@@ -202,40 +235,64 @@ namespace imghash {
 		}
 
 		//check dimensions
-		size_t rowsize = width * 3;
-		size_t size = rowsize * height; //TODO: overflow?
-		bool use_short = maxval > 0xFF;
-		if (use_short) size *= 2;
-		if (maxval > 0xFFFF) {
+		if (header.maxval > 0xFFFF) {
 			throw std::runtime_error("PPM: Invalid maxval");
 		}
-		if (size > maxsize) {
+		if (header.raster_size() > maxsize) { //TODO: overflow?
 			throw std::runtime_error("PPM: Size overflow");
 		}
+		return true;
+	}
+
+	Image<float> load_ppm(Input& input, Preprocess& prep, bool empty_error)
+	{
+		PPMHeader header;
+		if (!read_ppm_header(input, header, empty_error)) {
+			return Image<float>();
+		}
 		
 		// 9. Raster (width x height x 3) bytes, x2 if maxval > 255, MSB first
-		prep.start(height, width, 3);
-		if (use_short) {
+		size_t rowsize = header.width * header.channels;
+		prep.start(header.height, header.width, header.channels);
+		if (header.maxval > 0xFF) {
 			std::vector<uint16_t> row(rowsize, 0);
 			do {
-				size_t i;
-				for (i = 0; i < rowsize; ++i) {
-					if (fread(buffer, 1, 2, file) < 2) break;
-					row[i] = (buffer[0] << 8) | (buffer[1]); //deal with endianness
-				}
-				if (i < rowsize) {
+				const uint8_t* data;
+				if (input.peek(data, 2 * rowsize) < 2 * rowsize) {
 					throw std::runtime_error("PPM: Not enough data");
 				}
+				load_msb_first(data, rowsize, row.data());
+				input.skip(2 * rowsize);
 			} while (prep.add_row(row.data()));
 		}
 		else {
-			std::vector<uint8_t> row(rowsize, 0);
+			//the rows are used in place, in the input's buffer
+			const uint8_t* row;
 			do {
-				if (fread(row.data(), 1, rowsize, file) < rowsize) {
+				if (input.peek(row, rowsize) < rowsize) {
 					throw std::runtime_error("PPM: Not enough data");
 				}
+				input.skip(rowsize);
+			} while (prep.add_row(row));
+		}
+		return prep.stop();
+	}
+
+	Image<float> load_ppm_raster(const PPMHeader& header, const uint8_t* raster, Preprocess& prep)
+	{
+		size_t rowsize = header.width * header.channels;
+		prep.start(header.height, header.width, header.channels);
+		if (header.maxval > 0xFF) {
+			std::vector<uint16_t> row(rowsize, 0);
+			do {
+				load_msb_first(raster, rowsize, row.data());
+				raster += 2 * rowsize;
 			} while (prep.add_row(row.data()));
 		}
+		else {
+			//the rows can be used in place
+			for (; prep.add_row(raster); raster += rowsize);
+		}
 		return prep.stop();
 	}
 
@@ -280,6 +337,29 @@ namespace imghash {
 		}
 		return static_cast<uint32_t>(d);
 	}
+	void Hasher::hamming_distance(const hash_type& h, const hash_type& hs, size_t stride, uint32_t* out)
+	{
+		if (stride == 0) return;
+		//compare 64 bits at a time, loading h only once
+		size_t n = std::min(h.size(), stride);
+		size_t nw = n / 8;
+		std::vector<uint64_t> hw(nw);
+		std::memcpy(hw.data(), h.data(), nw * 8);
+
+		for (const uint8_t* p = hs.data(), *end = p + (hs.size() / stride) * stride; p < end; p += stride, ++out) {
+			size_t d = 0;
+			for (size_t i = 0; i < nw; ++i) {
+				uint64_t w;
+				std::memcpy(&w, p + 8 * i, 8);
+				d += std::bitset<64>(hw[i] ^ w).count();
+			}
+			for (size_t i = nw * 8; i < n; ++i) {
+				d += std::bitset<8>(h[i] ^ p[i]).count();
+			}
+			*out = static_cast<uint32_t>(d);
+		}
+	}
+
 	uint32_t Hasher::distance(const hash_type& h1, const hash_type& h2)
 	{
 		return hamming_distance(h1, h2);
@@ -360,6 +440,28 @@ namespace imghash {
 		return type_string_;
 	}
 
+	bool DCTHasher::is_prefix(const std::string& type, const std::string& full_type)
+	{
+		//type strings are "DCT{M}" or "DCT{M}E", as built in the constructor
+		auto parse = [](const std::string& str, unsigned& M, bool& even) {
+			if (str.compare(0, 3, "DCT") != 0) return false;
+			size_t i = 3;
+			M = 0;
+			for (; i < str.size() && isdigit(static_cast<unsigned char>(str[i])); ++i) {
+				M = 10 * M + (str[i] - '0');
+			}
+			if (i == 3) return false;
+			even = (i < str.size() && str[i] == 'E');
+			if (even) ++i;
+			return i == str.size();
+		};
+		unsigned M1, M2;
+		bool even1, even2;
+		if (!parse(type, M1, even1) || !parse(full_type, M2, even2)) return false;
+		//the distance is computed over whole bytes, so the shorter hash mustn't end part way through one
+		return even1 == even2 && M1 <= M2 && (M1 * M1) % 8 == 0;
+	}
+
 	std::vector<float> DCTHasher::mat(unsigned N, unsigned M)
 	{
 		if (M > N) M = N;
@@ -10,6 +10,8 @@
 #include <memory>
 #include <cstdio>
 
+#include "input.h"
+
 namespace imghash {
 
 	template<class T> struct Image;
@@ -17,19 +19,37 @@ namespace imghash {
 	class Preprocess;
 
 	Image<float> load(const std::string& fname, Preprocess& prep);
+	//! Load an image of any supported format, sniffed from its first bytes
+	Image<float> load(Input& input, Preprocess& prep);
 
 	void save(const std::string& fname, const Image<float>& img, float vmax = 1.0f);
 
 #ifdef USE_JPEG
-	bool test_jpeg(FILE* file);
-	Image<float> load_jpeg(FILE* file, Preprocess& prep);
+	bool test_jpeg(Input& input);
+	//! If reduced, the image is decoded at up to 1/8 scale, as long as it's still as big as prep's output
+	Image<float> load_jpeg(Input& input, Preprocess& prep, bool reduced = false);
 #endif
 #ifdef USE_PNG
-	bool test_png(FILE* file);
-	Image<float> load_png(FILE* file, Preprocess& prep);
+	bool test_png(Input& input);
+	Image<float> load_png(Input& input, Preprocess& prep);
 #endif
-	bool test_ppm(FILE* file);
-	Image<float> load_ppm(FILE* file, Preprocess& prep, bool empty_error = true);
+	//! The header of a binary PPM (P6) or PGM (P5) image
+	struct PPMHeader {
+		size_t width, height, maxval;
+		size_t channels; // 3 for PPM, 1 for PGM
+
+		//! The size of the raster in bytes
+		size_t raster_size() const { return width * height * channels * (maxval > 0xFF ? 2 : 1); }
+	};
+
+	bool test_ppm(Input& input);
+	Image<float> load_ppm(Input& input, Preprocess& prep, bool empty_error = true);
+	//! Read a PPM header, leaving input at the start of the raster. Returns false on an empty input if !empty_error
+	bool read_ppm_header(Input& input, PPMHeader& header, bool empty_error = true);
+	//! Convert n 16-bit samples stored MSB first (as in PPM) to native order
+	void load_msb_first(const uint8_t* data, size_t n, uint16_t* out);
+	//! Load a PPM raster that has already been read into memory (e.g. mapped), passing its rows to prep in place
+	Image<float> load_ppm_raster(const PPMHeader& header, const uint8_t* raster, Preprocess& prep);
 
 	template<class T> T convert_pix(uint8_t p);
 	template<class T> T convert_pix(uint16_t p);
@@ -227,6 +247,10 @@ namespace imghash {
 		Preprocess();
 		Preprocess(size_t w, size_t h);
 
+		//the size of the preprocessed image
+		size_t width() const { return img.width; }
+		size_t height() const { return img.height; }
+
 		//by row:
 		void start(size_t input_height, size_t input_width, size_t input_channels);
 		
@@ -310,6 +334,10 @@ namespace imghash {
 		//bitwise distance, up to the length of the shorter hash
 		static uint32_t hamming_distance(const hash_type& h1, const hash_type& h2);
 
+		//bitwise distance from h to each of the hashes packed end to end in hs, each stride bytes long
+		// up to the length of the shorter hash. out must have room for hs.size() / stride results
+		static void hamming_distance(const hash_type& h, const hash_type& hs, size_t stride, uint32_t* out);
+
 		static uint32_t distance(const hash_type& h1, const hash_type& h2);
 	};
 
@@ -400,6 +428,16 @@ namespace imghash {
 
 		//! Get the hasher's type string
 		const std::string& get_type() const override;
+
+		//! Check if hashes of one DCT type are prefixes of hashes of another
+		/*!
+		Because the bits are ordered in square shells, a hash with fewer DCT terms is a prefix
+		of a hash with more, as long as both use the same frequencies (even or not).
+		\param type The type string of the shorter hash
+		\param full_type The type string of the longer hash
+		\return true if both are DCT types, and type's hashes are a whole-byte prefix of full_type's
+		*/
+		static bool is_prefix(const std::string& type, const std::string& full_type);
 	};
 
 }
@@ -0,0 +1,138 @@
+#include "input.h"
+
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace imghash {
+
+	Input::Input(FILE* file, size_t buffer_size)
+		: file(file), buffer(buffer_size > 0 ? buffer_size : 1), pos(buffer.data()), end(buffer.data())
+	{
+		//nothing else to do
+	}
+
+	Input::Input(const uint8_t* data, size_t size)
+		: file(nullptr), buffer(), pos(data), end(data + size)
+	{
+		//nothing else to do
+	}
+
+	bool Input::fill(size_t n)
+	{
+		size_t available = end - pos;
+		if (available >= n) return true;
+		if (file == nullptr) return false;
+
+		//move what's left to the front, and make room for n
+		std::memmove(buffer.data(), pos, available);
+		if (n > buffer.size()) buffer.resize(n);
+		pos = buffer.data();
+		end = pos + available;
+
+		//fread waits for as much as we ask for, so a short read means the end of the input
+		size_t count = fread(buffer.data() + available, 1, buffer.size() - available, file);
+		end += count;
+		return available + count >= n;
+	}
+
+	size_t Input::peek(const uint8_t*& data, size_t n)
+	{
+		fill(n);
+		data = pos;
+		return std::min(n, static_cast<size_t>(end - pos));
+	}
+
+	size_t Input::read(void* data, size_t n)
+	{
+		uint8_t* out = static_cast<uint8_t*>(data);
+		size_t count = std::min(n, static_cast<size_t>(end - pos));
+		std::memcpy(out, pos, count);
+		pos += count;
+		if (count < n && file != nullptr) {
+			//large reads go straight to the destination, rather than through the buffer
+			if (n - count >= buffer.size()) {
+				count += fread(out + count, 1, n - count, file);
+			}
+			else if (fill(n - count) || pos < end) {
+				size_t more = std::min(n - count, static_cast<size_t>(end - pos));
+				std::memcpy(out + count, pos, more);
+				pos += more;
+				count += more;
+			}
+		}
+		return count;
+	}
+
+	size_t Input::next(const uint8_t*& data)
+	{
+		if (pos == end) fill(1);
+		data = pos;
+		size_t count = end - pos;
+		pos = end;
+		return count;
+	}
+
+	FileInfo stat_file(const std::string& fname)
+	{
+		FileInfo info;
+#ifdef _WIN32
+		struct _stat64 st;
+		if (_stat64(fname.c_str(), &st) != 0 || !(st.st_mode & _S_IFREG)) return info;
+		info.mtime = static_cast<int64_t>(st.st_mtime) * 1000000000;
+#else
+		struct stat st;
+		if (stat(fname.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) return info;
+#ifdef __APPLE__
+		info.mtime = static_cast<int64_t>(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+		info.mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+#endif
+		info.size = static_cast<int64_t>(st.st_size);
+		info.inode = static_cast<int64_t>(st.st_ino);
+		return info;
+	}
+
+	MappedFile::MappedFile(const std::string& fname)
+		: ptr(nullptr), len(0)
+	{
+#ifndef _WIN32
+		//anything but a regular file is left to stdio unopened, as opening a pipe here would lose it
+		struct stat st;
+		if (stat(fname.c_str(), &st) == 0 && !S_ISREG(st.st_mode)) return;
+
+		int fd = open(fname.c_str(), O_RDONLY);
+		if (fd < 0) {
+			throw std::runtime_error("Failed to open file");
+		}
+		if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+			void* p = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+			if (p != MAP_FAILED) {
+				ptr = static_cast<const uint8_t*>(p);
+				len = static_cast<size_t>(st.st_size);
+				madvise(p, len, MADV_SEQUENTIAL);
+			}
+		}
+		//the mapping outlives the descriptor
+		close(fd);
+#endif
+	}
+
+	MappedFile::~MappedFile()
+	{
+#ifndef _WIN32
+		if (ptr) munmap(const_cast<uint8_t*>(ptr), len);
+#endif
+	}
+
+}
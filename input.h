@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <vector>
+#include <string>
+
+namespace imghash {
+
+	//! A source of bytes with a prefetch buffer
+	/*!
+	Formats are sniffed by peeking at the buffered bytes rather than seeking back, so an input is read in
+	one pass, and pipes work as well as files. The bytes come from a FILE, or from memory (without a copy).
+	*/
+	class Input
+	{
+		FILE* file; // nullptr for memory
+		std::vector<uint8_t> buffer;
+		const uint8_t* pos; // the next byte
+		const uint8_t* end; // the end of the buffered bytes
+
+		//make at least n bytes available, returns false if the input ends first
+		bool fill(size_t n);
+	public:
+		//! Read from file, which stays open
+		explicit Input(FILE* file, size_t buffer_size = 0x10000);
+		//! Read from memory, which must outlive the Input
+		Input(const uint8_t* data, size_t size);
+
+		Input(const Input&) = delete;
+		Input& operator=(const Input&) = delete;
+
+		//! Look at the next n bytes without consuming them
+		/*!
+		Returns the number of bytes available, which is less than n only at the end of the input
+		*/
+		size_t peek(const uint8_t*& data, size_t n);
+
+		//! Consume n bytes, which must have been peeked
+		void skip(size_t n) { pos += n; }
+
+		//! Read up to n bytes, returns the number read
+		size_t read(void* data, size_t n);
+
+		//! Read a byte, or EOF at the end of the input
+		int get() {
+			if (pos == end && !fill(1)) return EOF;
+			return *pos++;
+		}
+
+		//! Consume whatever is buffered (reading more if nothing is), for handing to a decoder without a copy
+		/*!
+		Returns the number of bytes, 0 at the end of the input
+		*/
+		size_t next(const uint8_t*& data);
+
+		//! Give back the last n bytes from next, that the decoder didn't use
+		void unread(size_t n) { pos -= n; }
+
+		//! Is there nothing left?
+		bool at_end() {
+			const uint8_t* data;
+			return peek(data, 1) == 0;
+		}
+	};
+
+	//! The size, modification time (ns) and inode of a file, to tell whether it has changed
+	/*!
+	A size of -1 means unknown, e.g. the file couldn't be stat'd or isn't a regular file, so it can't be
+	told apart from a changed one
+	*/
+	struct FileInfo {
+		int64_t size = -1;
+		int64_t mtime = 0;
+		int64_t inode = 0;
+
+		bool operator==(const FileInfo& other) const {
+			return size == other.size && mtime == other.mtime && inode == other.inode;
+		}
+		bool operator!=(const FileInfo& other) const { return !(*this == other); }
+	};
+
+	//! Get the info of a file, following links
+	FileInfo stat_file(const std::string& fname);
+
+	//! A whole file mapped read-only into memory, for reading through an Input without copying
+	/*!
+	Only on POSIX systems, and only for regular, non-empty files: otherwise data() is nullptr and the file
+	should be read with stdio instead. The kernel is told the file will be read sequentially.
+	*/
+	class MappedFile
+	{
+		const uint8_t* ptr;
+		size_t len;
+	public:
+		//! Throws if the file can't be opened
+		explicit MappedFile(const std::string& fname);
+		~MappedFile();
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		const uint8_t* data() const { return ptr; }
+		size_t size() const { return len; }
+	};
+
+}
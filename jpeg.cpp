@@ -1,6 +1,7 @@
 #include "imghash.h"
 
 #include "jpeglib.h"
+#include "jerror.h"
 
 #include <cstdio>
 #include <csetjmp>
@@ -32,21 +33,65 @@ namespace {
 		// return control to load_jpeg (at setjmp)
 		longjmp(my_err->setjmp_buffer, 1);
 	}
+
+	//jpeg source manager reading from an Input's buffer
+	struct input_source_mgr {
+		jpeg_source_mgr mgr;
+		Input* input;
+		bool borrowed; // the buffer is the input's, rather than the fake EOI
+	};
+
+	void init_source(j_decompress_ptr cinfo) {}
+
+	boolean fill_input_buffer(j_decompress_ptr cinfo)
+	{
+		static const JOCTET eoi[2] = { 0xFF, JPEG_EOI };
+		input_source_mgr* src = (input_source_mgr*)(cinfo->src);
+		const uint8_t* data;
+		size_t n = src->input->next(data);
+		if (n == 0) {
+			//truncated: warn, and end the image as libjpeg's own sources do
+			WARNMS(cinfo, JWRN_JPEG_EOF);
+			data = eoi;
+			n = 2;
+		}
+		src->borrowed = (data != eoi);
+		src->mgr.next_input_byte = data;
+		src->mgr.bytes_in_buffer = n;
+		return TRUE;
+	}
+
+	void skip_input_data(j_decompress_ptr cinfo, long num_bytes)
+	{
+		input_source_mgr* src = (input_source_mgr*)(cinfo->src);
+		while (num_bytes > (long)src->mgr.bytes_in_buffer) {
+			num_bytes -= (long)src->mgr.bytes_in_buffer;
+			fill_input_buffer(cinfo);
+		}
+		if (num_bytes > 0) {
+			src->mgr.next_input_byte += num_bytes;
+			src->mgr.bytes_in_buffer -= num_bytes;
+		}
+	}
+
+	void term_source(j_decompress_ptr cinfo)
+	{
+		//leave the input just after the image
+		input_source_mgr* src = (input_source_mgr*)(cinfo->src);
+		if (src->borrowed) src->input->unread(src->mgr.bytes_in_buffer);
+		src->mgr.bytes_in_buffer = 0;
+	}
 }
 
 namespace imghash {
-	bool test_jpeg(FILE* file)
+	bool test_jpeg(Input& input)
 	{
-		unsigned char magic[2] = { 0 };
-		
-		auto off = ftell(file);
-		size_t n = fread(magic, sizeof(unsigned char), 2, file);
-		fseek(file, off, SEEK_SET);
-
+		const uint8_t* magic;
+		size_t n = input.peek(magic, 2);
 		return (n == 2) && (magic[0] == 0xFF) && (magic[1] == 0xD8);
 	}
 
-	Image<float> load_jpeg(FILE* file, Preprocess& prep)
+	Image<float> load_jpeg(Input& input, Preprocess& prep, bool reduced)
 	{
 		//1. Allocate & init decompression object
 		jpeg_decompress_struct cinfo{ 0 };
@@ -64,7 +109,17 @@ namespace imghash {
 		jpeg_create_decompress(&cinfo);
 
 		//2. Open source
-		jpeg_stdio_src(&cinfo, file);
+		input_source_mgr src;
+		src.mgr.init_source = init_source;
+		src.mgr.fill_input_buffer = fill_input_buffer;
+		src.mgr.skip_input_data = skip_input_data;
+		src.mgr.resync_to_restart = jpeg_resync_to_restart;
+		src.mgr.term_source = term_source;
+		src.mgr.next_input_byte = nullptr;
+		src.mgr.bytes_in_buffer = 0;
+		src.input = &input;
+		src.borrowed = false;
+		cinfo.src = &src.mgr;
 
 		//3. Read header
 		jpeg_read_header(&cinfo, TRUE);
@@ -72,6 +127,16 @@ namespace imghash {
 		//4. Adjust decompression settings
 		cinfo.out_color_space = JCS_RGB;
 		cinfo.quantize_colors = false;
+		if (reduced) {
+			cinfo.scale_num = 1;
+			cinfo.scale_denom = 1;
+			for (unsigned int d = 8; d > 1; d /= 2) {
+				if ((cinfo.image_width + d - 1) / d >= prep.width() && (cinfo.image_height + d - 1) / d >= prep.height()) {
+					cinfo.scale_denom = d;
+					break;
+				}
+			}
+		}
 
 		//5. Begin decompression
 		jpeg_start_decompress(&cinfo);
@@ -92,4 +157,3 @@ namespace imghash {
 		return prep.stop();
 	}
 }
-
@@ -0,0 +1,211 @@
+#include "libimghash.h"
+#include "imghash.h"
+
+#include <string>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <bitset>
+#include <algorithm>
+
+struct imghash_context {
+	imghash::Preprocess prep;
+	std::unique_ptr<imghash::Hasher> hasher;
+	size_t hash_size;
+	std::string error;
+
+	//the image being added row by row: the rows still to come, and their sample size once the first is added
+	size_t rows_left;
+	size_t row_size;
+	bool begun;
+	bool wants_rows; // the preprocessor needs more rows, it may stop before the last
+
+	imghash_context() : prep(128, 128), hash_size(0), rows_left(0), row_size(0), begun(false), wants_rows(false) {}
+
+	int fail(int code, const char* message)
+	{
+		error = message;
+		return code;
+	}
+
+	//store the hash of the preprocessed image
+	int output(const imghash::Image<float>& img, uint8_t* hash)
+	{
+		auto h = hasher->apply(img);
+		std::copy(h.begin(), h.end(), hash);
+		error.clear();
+		return IMGHASH_OK;
+	}
+};
+
+namespace {
+	//call f, turning what it throws into an error code
+	template<class F>
+	int guard(imghash_context* ctx, int code, F f)
+	{
+		try {
+			return f();
+		}
+		catch (std::bad_alloc&) {
+			return ctx->fail(IMGHASH_ERROR, "Out of memory");
+		}
+		catch (std::exception& e) {
+			return ctx->fail(code, e.what());
+		}
+		catch (...) {
+			return ctx->fail(IMGHASH_ERROR, "Unknown error");
+		}
+	}
+
+	template<class T>
+	int hash_pixels(imghash_context* ctx, const T* pixels, size_t width, size_t height, size_t channels, size_t stride,
+		uint8_t* hash, size_t hash_size)
+	{
+		if (!ctx) return IMGHASH_ERROR_ARGUMENT;
+		if (!pixels || !hash || width == 0 || height == 0 || channels == 0 || stride < width * channels * sizeof(T)) {
+			return ctx->fail(IMGHASH_ERROR_ARGUMENT, "Invalid image");
+		}
+		if (hash_size < ctx->hash_size) return ctx->fail(IMGHASH_ERROR_BUFFER, "Hash buffer too small");
+		return guard(ctx, IMGHASH_ERROR, [&]() {
+			ctx->begun = false;
+			ctx->prep.start(height, width, channels);
+			const uint8_t* row = reinterpret_cast<const uint8_t*>(pixels);
+			for (size_t y = 0; y < height && ctx->prep.add_row(reinterpret_cast<const T*>(row)); ++y, row += stride);
+			return ctx->output(ctx->prep.stop(), hash);
+		});
+	}
+
+	template<class T>
+	int add_row(imghash_context* ctx, const T* row)
+	{
+		if (!ctx) return IMGHASH_ERROR_ARGUMENT;
+		if (!row) return ctx->fail(IMGHASH_ERROR_ARGUMENT, "Invalid row");
+		if (!ctx->begun || ctx->rows_left == 0) return ctx->fail(IMGHASH_ERROR_STATE, "No row expected");
+		if (ctx->row_size != sizeof(T)) return ctx->fail(IMGHASH_ERROR_STATE, "Rows of mixed sample sizes");
+		return guard(ctx, IMGHASH_ERROR, [&]() {
+			--ctx->rows_left;
+			//rows past the last the preprocessor uses are only counted
+			if (ctx->wants_rows) ctx->wants_rows = ctx->prep.add_row(row);
+			return IMGHASH_OK;
+		});
+	}
+}
+
+extern "C" {
+
+int imghash_api_version(void)
+{
+	return IMGHASH_API_VERSION;
+}
+
+imghash_context* imghash_create(int dct_size, int even)
+{
+	if (dct_size < 0 || dct_size > 4) return nullptr;
+	try {
+		auto ctx = std::make_unique<imghash_context>();
+		if (dct_size > 0) {
+			ctx->hasher = std::make_unique<imghash::DCTHasher>(8 * dct_size, even != 0);
+			//M x M bits
+			ctx->hash_size = 8 * dct_size * dct_size;
+		}
+		else {
+			ctx->hasher = std::make_unique<imghash::BlockHasher>();
+			ctx->hash_size = 8;
+		}
+		return ctx.release();
+	}
+	catch (...) {
+		return nullptr;
+	}
+}
+
+void imghash_destroy(imghash_context* ctx)
+{
+	delete ctx;
+}
+
+size_t imghash_hash_size(const imghash_context* ctx)
+{
+	return ctx ? ctx->hash_size : 0;
+}
+
+const char* imghash_type(const imghash_context* ctx)
+{
+	return ctx ? ctx->hasher->get_type().c_str() : "";
+}
+
+const char* imghash_error(const imghash_context* ctx)
+{
+	return ctx ? ctx->error.c_str() : "";
+}
+
+int imghash_hash_file(imghash_context* ctx, const void* data, size_t size, uint8_t* hash, size_t hash_size)
+{
+	if (!ctx) return IMGHASH_ERROR_ARGUMENT;
+	if (!data || !hash) return ctx->fail(IMGHASH_ERROR_ARGUMENT, "Invalid argument");
+	if (hash_size < ctx->hash_size) return ctx->fail(IMGHASH_ERROR_BUFFER, "Hash buffer too small");
+	return guard(ctx, IMGHASH_ERROR_DECODE, [&]() {
+		ctx->begun = false;
+		imghash::Input input(static_cast<const uint8_t*>(data), size);
+		return ctx->output(imghash::load(input, ctx->prep), hash);
+	});
+}
+
+int imghash_hash_pixels(imghash_context* ctx, const uint8_t* pixels, size_t width, size_t height, size_t channels,
+	size_t stride, uint8_t* hash, size_t hash_size)
+{
+	return hash_pixels(ctx, pixels, width, height, channels, stride, hash, hash_size);
+}
+
+int imghash_hash_pixels16(imghash_context* ctx, const uint16_t* pixels, size_t width, size_t height, size_t channels,
+	size_t stride, uint8_t* hash, size_t hash_size)
+{
+	return hash_pixels(ctx, pixels, width, height, channels, stride, hash, hash_size);
+}
+
+int imghash_begin(imghash_context* ctx, size_t width, size_t height, size_t channels)
+{
+	if (!ctx) return IMGHASH_ERROR_ARGUMENT;
+	if (width == 0 || height == 0 || channels == 0) return ctx->fail(IMGHASH_ERROR_ARGUMENT, "Invalid image");
+	return guard(ctx, IMGHASH_ERROR, [&]() {
+		ctx->prep.start(height, width, channels);
+		ctx->rows_left = height;
+		ctx->row_size = 0;
+		ctx->begun = true;
+		ctx->wants_rows = true;
+		return IMGHASH_OK;
+	});
+}
+
+int imghash_add_row(imghash_context* ctx, const uint8_t* row)
+{
+	if (ctx && ctx->begun && ctx->row_size == 0) ctx->row_size = sizeof(uint8_t);
+	return add_row(ctx, row);
+}
+
+int imghash_add_row16(imghash_context* ctx, const uint16_t* row)
+{
+	if (ctx && ctx->begun && ctx->row_size == 0) ctx->row_size = sizeof(uint16_t);
+	return add_row(ctx, row);
+}
+
+int imghash_end(imghash_context* ctx, uint8_t* hash, size_t hash_size)
+{
+	if (!ctx) return IMGHASH_ERROR_ARGUMENT;
+	if (!hash) return ctx->fail(IMGHASH_ERROR_ARGUMENT, "Invalid argument");
+	if (hash_size < ctx->hash_size) return ctx->fail(IMGHASH_ERROR_BUFFER, "Hash buffer too small");
+	if (!ctx->begun || ctx->rows_left > 0) return ctx->fail(IMGHASH_ERROR_STATE, "Image incomplete");
+	return guard(ctx, IMGHASH_ERROR, [&]() {
+		ctx->begun = false;
+		return ctx->output(ctx->prep.stop(), hash);
+	});
+}
+
+uint32_t imghash_distance(const uint8_t* hash1, const uint8_t* hash2, size_t size)
+{
+	uint32_t d = 0;
+	for (size_t i = 0; i < size; ++i) d += static_cast<uint32_t>(std::bitset<8>(hash1[i] ^ hash2[i]).count());
+	return d;
+}
+
+}
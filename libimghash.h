@@ -0,0 +1,74 @@
+#pragma once
+
+/*
+ * libimghash: the C API of imghash, for computing perceptual image hashes in process.
+ *
+ * Images are passed as whole files in memory (any supported format), or as raw 8 or 16-bit pixels,
+ * whole or a row at a time. Hashes are written to storage the caller provides.
+ *
+ * A context holds the buffers and the hasher (including the DCT matrix), so it should be created once
+ * and reused. A context must not be used by two threads at once, but any number of contexts may be.
+ *
+ * Functions returning int return IMGHASH_OK (0) on success, or a negative error code, with a message
+ * from imghash_error(). The API is only ever extended: IMGHASH_API_VERSION is bumped when it is.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define IMGHASH_API_VERSION 1
+
+enum {
+	IMGHASH_OK = 0,
+	IMGHASH_ERROR_ARGUMENT = -1, /* e.g. a null pointer, or an image with no pixels */
+	IMGHASH_ERROR_BUFFER = -2,   /* the output is smaller than imghash_hash_size() */
+	IMGHASH_ERROR_DECODE = -3,   /* the image can't be decoded, or its format isn't supported */
+	IMGHASH_ERROR_STATE = -4,    /* e.g. a row added before imghash_begin() */
+	IMGHASH_ERROR = -5           /* anything else, e.g. out of memory */
+};
+
+typedef struct imghash_context imghash_context;
+
+/* The API version the library was built with, to check against IMGHASH_API_VERSION */
+int imghash_api_version(void);
+
+/* Create a context. dct_size 0 is the 64-bit block average hash, 1 to 4 the DCT hash of 64, 256, 576 or
+ * 1024 bits (with even frequencies only, if even is non-zero). Returns NULL if dct_size is invalid */
+imghash_context* imghash_create(int dct_size, int even);
+
+void imghash_destroy(imghash_context* ctx);
+
+/* The size of a hash in bytes */
+size_t imghash_hash_size(const imghash_context* ctx);
+
+/* The hash type, as stored in an imghash database, e.g. "DCT8E" */
+const char* imghash_type(const imghash_context* ctx);
+
+/* The message of the last error on the context, or "" */
+const char* imghash_error(const imghash_context* ctx);
+
+/* Hash an image file that's in memory */
+int imghash_hash_file(imghash_context* ctx, const void* data, size_t size, uint8_t* hash, size_t hash_size);
+
+/* Hash raw pixels: height rows of width pixels of channels interleaved samples, stride bytes apart */
+int imghash_hash_pixels(imghash_context* ctx, const uint8_t* pixels, size_t width, size_t height, size_t channels,
+	size_t stride, uint8_t* hash, size_t hash_size);
+int imghash_hash_pixels16(imghash_context* ctx, const uint16_t* pixels, size_t width, size_t height, size_t channels,
+	size_t stride, uint8_t* hash, size_t hash_size);
+
+/* Hash raw pixels a row at a time, e.g. as they're decoded: begin, add height rows, then end */
+int imghash_begin(imghash_context* ctx, size_t width, size_t height, size_t channels);
+int imghash_add_row(imghash_context* ctx, const uint8_t* row);
+int imghash_add_row16(imghash_context* ctx, const uint16_t* row);
+int imghash_end(imghash_context* ctx, uint8_t* hash, size_t hash_size);
+
+/* The number of bits that differ between two hashes of size bytes */
+uint32_t imghash_distance(const uint8_t* hash1, const uint8_t* hash2, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,5 +1,12 @@
 
 #include "imghash.h"
+#include "threadpool.h"
+#include "stream.h"
+#include "filereader.h"
+#include "paths.h"
+#include "digest.h"
+#include "hashcache.h"
+#include "server.h"
 
 #include <iostream>
 #include <iomanip>
@@ -7,6 +14,14 @@
 #include <sstream>
 #include <vector>
 #include <tuple>
+#include <exception>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <optional>
+#include <algorithm>
+#include <filesystem>
 
 #ifdef _WIN32
 #include <fcntl.h>
@@ -23,19 +38,32 @@ void print_usage() {
 	std::cout << "  Outputs hexadecimal hash and filename for each file on a new line.\n";
 	std::cout << "  The default algorithm (if -d is not specified) is a fixed size 64-bit block average hash, with mirror & flip tolerance.\n";
 	std::cout << "  The DCT hash uses only even-mode coefficients, so it is mirror/flip tolerant.\n";
-	std::cout << "  If no FILE is given, reads ppm from stdin\n";
+	std::cout << "  If no FILE (or --files-from) is given, reads a stream of images from stdin, in any supported format, or y4m (yuv4mpegpipe)\n";
 	std::cout << "  OPTIONS are:\n";
 	std::cout << "    -h, --help : print this message and exit\n";
 	std::cout << "    -dN, --dct N : use dct hash. N may be one of 1,2,3,4 for 64,256,576,1024 bits respectively.\n";
 	std::cout << "    -q, --quiet : don't output filename.\n";
+	std::cout << "    --luma : hash only the luma plane of y4m frames from stdin, skipping the chroma.\n";
+	std::cout << "    -j N, --jobs N : hash N files (or stdin frames) at once, and scan N database partitions at once per query. Output is in the same order as the input.\n";
+	std::cout << "    -r, --recursive : hash the files in directories given as FILEs, and in their subdirectories, in no fixed order.\n";
+	std::cout << "    --ext LIST : with -r, hash only files with these comma separated extensions. By default, those of the supported formats.\n";
+	std::cout << "    --files-from LIST_FILE : also hash the files named in LIST_FILE (- for stdin), separated by NUL characters, as from find -print0.\n";
+	std::cout << "    --cache CACHE_FILE : keep the hashes of files in CACHE_FILE, by absolute path, size, modification time and inode, and don't hash unchanged files again.\n";
+	std::cout << "    --serve SOCKET : serve hash (and with --db, add, query and remove) requests on the Unix domain socket SOCKET until interrupted, decoding up to N images at once with -j N.\n";
 	std::cout << "    -n NAME, --name NAME : specify a name for output when reading from stdin\n";
 #ifdef USE_SQLITE
-	std::cout << "    --db DB_PATH : use the specified database for add, query, remove, rename, and exists.\n";
+	std::cout << "    --db DB_PATH : use the specified database for add, query, remove, rename, exists and compact.\n";
+	std::cout << "    --layout LIST : create the database with these comma separated layout options: packed (the distances from each point to the vantage points in one blob rather than an indexed column each: smaller, and faster to add to), clustered (the points indexed by partition along with their values, so a query reads each partition from contiguous pages; may be added to an existing database).\n";
+	std::cout << "    --shards N : create the database as N files (DB_PATH, DB_PATH.1, ...), added to and queried in parallel. An existing database keeps the number it was created with.\n";
 	std::cout << "    --add : add the image to the database. If the image comes from stdin, --name must be specified.\n";
+	std::cout << "    --update : with --add, skip files whose size, modification time and inode are unchanged since they were added, and replace the hashes of those that have changed.\n";
 	std::cout << "    --query DIST LIMIT : query the database for up to LIMIT similar images within DIST distance.\n";
+	std::cout << "    --max-partitions N : approximate query, scanning at most N partitions, nearest first. Coverage is reported on stderr.\n";
+	std::cout << "    --max-points N : approximate query, computing at most N distances. Coverage is reported on stderr.\n";
 	std::cout << "    --remove NAME : remove the name from the database. No input is processed if this is specified.\n";
 	std::cout << "    --rename OLDNAME NEWNAME : change the name of an image in the database. No input is processed if this is specified.\n";
 	std::cout << "    --exists NAME : check if an image has been inserted into the database. No input is processed if this is specified.\n";
+	std::cout << "    --compact SECONDS : remove the hashes no image has any more, rebalance, and rebuild the database, for up to SECONDS (0 for no limit). Exits with 100 if there's more to do, which another --compact carries on with. No input is processed if this is specified.\n";
 #endif
 	std::cout << "  Supported image formats: \n";
 #ifdef USE_JPEG
@@ -44,7 +72,7 @@ void print_usage() {
 #ifdef USE_PNG
 	std::cout << "    png\n";
 #endif
-	std::cout << "    ppm\n";
+	std::cout << "    ppm, pgm\n";
 }
 
 void print_version()
@@ -105,11 +133,29 @@ std::ostream& operator << (std::ostream& out, const join_t<Types...>& j) {
 }
 
 #ifdef USE_SQLITE
+void print_result(std::ostream& out, const imghash::Database::query_result& res,
+	const std::string& prefix = "  ", const std::string& delim = ": ", const std::string& suffix = "\n")
+{
+	out << prefix << join(delim, res) << suffix;
+}
+
 void print_query(std::ostream& out, const std::vector<imghash::Database::query_result>& results, 
 	const std::string& prefix = "  ", const std::string& delim = ": ", const std::string& suffix = "\n")
 {
 	for (const auto& res : results) {
-		out << prefix << join(delim, res) << suffix;
+		print_result(out, res, prefix, delim, suffix);
+	}
+}
+
+//stream query results to out as they are found
+// approximate queries also report their coverage to stderr
+void print_query(std::ostream& out, imghash::Database& db, const imghash::Database::point_type& hash, unsigned int dist, size_t limit,
+	const imghash::Database::query_budget& budget = {})
+{
+	auto stats = db.query(hash, dist, limit, [&](const imghash::Database::query_result& res) { print_result(out, res); }, budget);
+	if (budget.partitions > 0 || budget.points > 0) {
+		std::cerr << "  coverage: " << stats.partitions_scanned << "/" << stats.partitions << " partitions, "
+			<< stats.points_scanned << " points" << (stats.complete ? "" : " (approximate)") << "\n";
 	}
 }
 #endif
@@ -138,13 +184,34 @@ int main(int argc, const char* argv[])
 	bool use_dct = false;
 	bool binary = false;
 	bool quiet = false;
+	bool luma = false;
+	size_t jobs = 1;
+	bool recursive = false;
+	std::vector<std::string> extensions = imghash::default_extensions();
+	std::string files_from;
+	std::string cache_path;
+	std::string serve_path;
 	std::string db_path;
+#ifdef USE_SQLITE
+	size_t shards = 0;
+	bool packed = false;
+	bool clustered = false;
+#endif
 	bool add = false;
+	bool update = false;
 	unsigned int query_dist = 0;
 	size_t query_limit = 0;
+#ifdef USE_SQLITE
+	size_t max_partitions = 0;
+	size_t max_points = 0;
+#endif
 	bool remove = false;
 	bool rename = false;
 	bool exists = false;
+	bool compact = false;
+#ifdef USE_SQLITE
+	size_t compact_seconds = 0;
+#endif
 	std::string name, new_name;
 	
 	//parse options
@@ -177,6 +244,64 @@ int main(int argc, const char* argv[])
 					}
 				}
 				else if (arg == "-q" || arg == "--quiet") quiet = true;
+				else if (arg == "--luma") luma = true;
+				else if (arg == "-j" || arg == "--jobs") {
+					if (++i < argc) {
+						try {
+							jobs = static_cast<size_t>(std::stoul(argv[i]));
+						}
+						catch (...) {
+							throw std::runtime_error("Invalid number of jobs.");
+						}
+						if (jobs == 0) {
+							throw std::runtime_error("Invalid number of jobs.");
+						}
+					}
+					else {
+						throw std::runtime_error("Missing number of jobs.");
+					}
+				}
+				else if (arg == "-r" || arg == "--recursive") recursive = true;
+				else if (arg == "--ext") {
+					if (++i < argc) {
+						extensions.clear();
+						std::istringstream list(argv[i]);
+						std::string ext;
+						while (std::getline(list, ext, ',')) {
+							if (!ext.empty()) extensions.push_back(ext);
+						}
+						if (extensions.empty()) {
+							throw std::runtime_error("Invalid extension list.");
+						}
+					}
+					else {
+						throw std::runtime_error("Missing extension list.");
+					}
+				}
+				else if (arg == "--files-from") {
+					if (++i < argc) {
+						files_from = std::string(argv[i]);
+					}
+					else {
+						throw std::runtime_error("Missing list file name.");
+					}
+				}
+				else if (arg == "--cache") {
+					if (++i < argc) {
+						cache_path = std::string(argv[i]);
+					}
+					else {
+						throw std::runtime_error("Missing cache file name.");
+					}
+				}
+				else if (arg == "--serve") {
+					if (++i < argc) {
+						serve_path = std::string(argv[i]);
+					}
+					else {
+						throw std::runtime_error("Missing socket path.");
+					}
+				}
 				else if (arg == "-n" || arg == "--name") {
 					if (++i < argc) {
 						name = std::string(argv[i]);
@@ -195,9 +320,44 @@ int main(int argc, const char* argv[])
 						throw std::runtime_error("Missing database file name.");
 					}
 				}
+#ifdef USE_SQLITE
+				else if (arg == "--layout") {
+					if (++i < argc) {
+						std::istringstream list(argv[i]);
+						std::string option;
+						while (std::getline(list, option, ',')) {
+							if (option == "packed") packed = true;
+							else if (option == "clustered") clustered = true;
+							else if (!option.empty()) throw std::runtime_error("Invalid layout option: " + option);
+						}
+					}
+					else {
+						throw std::runtime_error("Missing layout options.");
+					}
+				}
+				else if (arg == "--shards") {
+					if (++i < argc) {
+						try {
+							shards = static_cast<size_t>(std::stoul(argv[i]));
+						}
+						catch (...) {
+							throw std::runtime_error("Invalid number of shards.");
+						}
+						if (shards == 0) {
+							throw std::runtime_error("Invalid number of shards.");
+						}
+					}
+					else {
+						throw std::runtime_error("Missing number of shards.");
+					}
+				}
+#endif
 				else if (arg == "--add") {
 					add = true;
 				}
+				else if (arg == "--update") {
+					update = true;
+				}
 				else if (arg == "--query") {
 					if(i + 2 < argc) {
 						try {
@@ -212,9 +372,26 @@ int main(int argc, const char* argv[])
 						throw std::runtime_error("Missing query distance and/or limit.");
 					}
 				}
+#ifdef USE_SQLITE
+				else if (arg == "--max-partitions" || arg == "--max-points") {
+					if (++i < argc) {
+						try {
+							auto n = static_cast<size_t>(std::stoull(argv[i]));
+							if (arg == "--max-partitions") max_partitions = n;
+							else max_points = n;
+						}
+						catch (...) {
+							throw std::runtime_error("Invalid query budget.");
+						}
+					}
+					else {
+						throw std::runtime_error("Missing query budget.");
+					}
+				}
+#endif
 				else if (arg == "--remove") {
 					remove = true;
-					exists = rename = false;
+					exists = rename = compact = false;
 					if (++i < argc) {
 						name = std::string(argv[i]);
 					}
@@ -224,7 +401,7 @@ int main(int argc, const char* argv[])
 				}
 				else if (arg == "--rename") {
 					rename = true;
-					exists = remove = false;
+					exists = remove = compact = false;
 					if (i + 2 < argc) {
 						name = std::string(argv[++i]);
 						new_name= std::string(argv[++i]);
@@ -235,7 +412,7 @@ int main(int argc, const char* argv[])
 				}
 				else if (arg == "--exists") {
 					exists = true;
-					remove = rename = false;
+					remove = rename = compact = false;
 					if (++i < argc) {
 						name = std::string(argv[i]);
 					}
@@ -243,6 +420,23 @@ int main(int argc, const char* argv[])
 						throw std::runtime_error("Missing exists name.");
 					}
 				}
+#ifdef USE_SQLITE
+				else if (arg == "--compact") {
+					compact = true;
+					remove = rename = exists = false;
+					if (++i < argc) {
+						try {
+							compact_seconds = static_cast<size_t>(std::stoull(argv[i]));
+						}
+						catch (...) {
+							throw std::runtime_error("Invalid compact time.");
+						}
+					}
+					else {
+						throw std::runtime_error("Missing compact time.");
+					}
+				}
+#endif
 				else {
 					throw std::runtime_error("Unknown option: " + arg);
 				}
@@ -252,12 +446,18 @@ int main(int argc, const char* argv[])
 			}
 		}
 
+		if (!serve_path.empty() && (!files.empty() || !files_from.empty() || add || remove || rename || exists || compact || query_limit > 0)) {
+			throw std::runtime_error("--serve takes no files or database operations, its clients send them.");
+		}
 #ifdef USE_SQLITE
-		if (db_path.empty() && (add || remove || rename || exists || query_limit > 0)) {
-			throw std::runtime_error("database operations (add, query, remove, rename, exists) require --db to be specified.");
+		if (db_path.empty() && (add || remove || rename || exists || compact || query_limit > 0)) {
+			throw std::runtime_error("database operations (add, query, remove, rename, exists, compact) require --db to be specified.");
+		}
+		if (update && !add) {
+			throw std::runtime_error("--update requires --add.");
 		}
 #else
-		if (!db_path.empty() || add || remove || rename || exists || query_limit > 0) {
+		if (!db_path.empty() || add || update || remove || rename || exists || compact || query_limit > 0) {
 			throw std::runtime_error("Support for database operations was not compiled. Rebuild with USE_SQLITE defined.");
 		}
 #endif
@@ -278,9 +478,16 @@ int main(int argc, const char* argv[])
 
 #ifdef USE_SQLITE
 		std::unique_ptr<imghash::Database> db;
-		if (!db_path.empty()) db = std::make_unique<imghash::Database>(db_path);
+		if (!db_path.empty()) {
+			//queries and checks of a database that's already there don't write it, so it's opened read only
+			bool read_only = !add && !rename && !remove && !compact && serve_path.empty() && std::filesystem::exists(db_path);
+			imghash::Database::layout_options layout{};
+			layout.packed = packed;
+			layout.clustered = clustered;
+			db = std::make_unique<imghash::Database>(db_path, read_only, shards, layout);
+		}
 
-		if (rename || remove || exists) {
+		if (rename || remove || exists || compact) {
 			if (rename) {
 				db->rename(name, new_name);
 			}
@@ -291,22 +498,70 @@ int main(int argc, const char* argv[])
 				if (db->exists(name)) return 0;
 				else return 100;
 			}
+			else if (compact) {
+				if (!db->compact(std::chrono::seconds(compact_seconds))) {
+					std::cerr << "Compaction is not finished, run --compact again to carry on." << std::endl;
+					return 100;
+				}
+			}
 			return 0;
 		}
+
+		imghash::Database::query_budget budget{};
+		budget.partitions = max_partitions;
+		budget.points = max_points;
+
+		//with -j, a query scans the partitions it covers in parallel
+		if (db && query_limit > 0 && jobs > 1) db->set_query_threads(jobs);
 #endif
 
 		imghash::Preprocess prep(128, 128);
 
-		std::unique_ptr<imghash::Hasher> hasher;
-		if (use_dct) hasher = std::make_unique<imghash::DCTHasher>(8 * dct_size, even);
-		else hasher = std::make_unique<imghash::BlockHasher>();
+		auto make_hasher = [&]() -> std::unique_ptr<imghash::Hasher> {
+			if (use_dct) return std::make_unique<imghash::DCTHasher>(8 * dct_size, even);
+			else return std::make_unique<imghash::BlockHasher>();
+		};
+		std::unique_ptr<imghash::Hasher> hasher = make_hasher();
 
 #ifdef USE_SQLITE
-		if (db && !db->check_hash_type(hasher->get_type())) {
+		//a database of longer DCT hashes can be queried with a prefix, but only exact matches can be added
+		if (db && !db->check_hash_type(hasher->get_type(), !add)) {
 			throw std::runtime_error("Database hash type mismatch");
 		}
 #endif
-		if (files.empty()) {
+
+		if (!serve_path.empty()) {
+			//everything is set up once, and kept for all of the requests
+#ifdef USE_SQLITE
+			imghash::Server server(serve_path, make_hasher, jobs, db.get());
+#else
+			imghash::Server server(serve_path, make_hasher, jobs, nullptr);
+#endif
+			server.run();
+			return 0;
+		}
+
+		//byte-identical copies of a file (this run, or added before) get its hash without being decoded
+		imghash::DigestTable digests;
+#ifdef USE_SQLITE
+		//the files already added and their digests are read before the writer takes the database
+		bool from_files = !files.empty() || !files_from.empty();
+		std::unordered_map<std::string, imghash::FileInfo> known;
+		if (from_files && update) known = db->file_infos();
+		if (from_files && db && add) {
+			for (const auto& d : db->digests()) digests.insert(d.first, d.second);
+		}
+
+		//files that are only added are committed in groups on a writer thread, and output once they are committed
+		std::unique_ptr<imghash::DatabaseWriter> writer;
+		if (db && add && query_limit == 0) {
+			writer = std::make_unique<imghash::DatabaseWriter>(*db,
+				[&](const imghash::Database::point_type& hash, const imghash::Database::item_type& item) {
+					print_hash(std::cout, hash, item, binary, quiet);
+				});
+		}
+#endif
+		if (files.empty() && files_from.empty()) {
 			//read from stdin
 #ifdef _WIN32
 			auto result = _setmode(_fileno(stdin), _O_BINARY);
@@ -319,36 +574,266 @@ int main(int argc, const char* argv[])
 			}
 #endif
 			
-			imghash::Image<float> img;
-			
-			img = load_ppm(stdin, prep);
-			while (img.size > 0) {
-				auto hash = hasher->apply(img);
+#ifdef USE_SQLITE
+			//exact queries that don't modify the database are batched so that consecutive frames share partition scans
+			const size_t query_batch_size = 256;
+			bool batch = db && query_limit > 0 && !add && max_partitions == 0 && max_points == 0;
+			std::vector<imghash::Database::point_type> batch_hashes;
+			auto print_batch = [&]() {
+				auto results = db->query_batch(batch_hashes, query_dist, query_limit);
+				for (size_t i = 0; i < batch_hashes.size(); ++i) {
+					print_hash(std::cout, batch_hashes[i], name, binary, quiet);
+					print_query(std::cout, results[i]);
+				}
+				batch_hashes.clear();
+			};
+#endif
+
+			//frames are read on one thread and hashed on `jobs` others, while this one outputs them in order
+			imghash::Input input(stdin);
+			auto stream = imghash::open_stream(input, luma);
+			imghash::HashPipeline pipeline(*stream, 128, 128, make_hasher, jobs);
+			std::vector<uint8_t> hash;
+			while (pipeline.next(hash)) {
+				#ifdef USE_SQLITE
+				if (batch) {
+					batch_hashes.push_back(std::move(hash));
+					if (batch_hashes.size() >= query_batch_size) print_batch();
+					continue;
+				}
+				if (writer) {
+					writer->push(std::move(hash), name);
+					continue;
+				}
+				#endif
 				print_hash(std::cout, hash, name, binary, quiet);
 				#ifdef USE_SQLITE
 				if (db) {
 					if (add) db->insert(hash, name);
-					if (query_limit > 0) print_query(std::cout, db->query(hash, query_dist, query_limit));
+					if (query_limit > 0) print_query(std::cout, *db, hash, query_dist, query_limit, budget);
 				}
 				#endif
-				img = load_ppm(stdin, prep, false); //it's OK to get an empty file here
 			}
+			#ifdef USE_SQLITE
+			if (batch) print_batch();
+			#endif
 		}
 		else {
-			//read from list of files
-			for (const auto& file : files) {
-				imghash::Image<float> img = load(file, prep);
-				
-				auto hash = hasher->apply(img);
+			//read from list of files, found as they're hashed
+			imghash::PathSource paths(std::move(files), files_from, recursive, extensions, jobs);
+
+			std::unique_ptr<imghash::HashCache> cache;
+			if (!cache_path.empty()) cache = std::make_unique<imghash::HashCache>(cache_path, hasher->get_type());
+
+			//files that are added are stat'd before they're read, so that a later --update can tell if they've changed
+			// and so are files looked up in the cache
+			std::unordered_map<std::string, imghash::FileInfo> infos;
+			std::mutex infos_mutex;
+			bool stat_files = cache != nullptr;
+#ifdef USE_SQLITE
+			stat_files = stat_files || add;
+#endif
+			//stat a file, returns true if it should be skipped. Gets its hash if it's cached, or clears it
+			auto check = [&](const std::string& file, std::vector<uint8_t>& cached) {
+				cached.clear();
+				if (!stat_files) return false;
+				auto info = imghash::stat_file(file);
+				#ifdef USE_SQLITE
+				auto k = known.find(file);
+				if (info.size >= 0 && k != known.end() && k->second == info) return true;
+				#endif
+				if (cache && info.size >= 0) cache->find(file, info, cached);
+				std::lock_guard<std::mutex> lock(infos_mutex);
+				infos[file] = info;
+				return false;
+			};
+
+			auto hash_file = [&](const uint8_t* data, size_t size, imghash::Preprocess& p, imghash::Hasher& h, imghash::Digest& d) {
+				d = imghash::digest(data, size);
+				std::vector<uint8_t> hash;
+				if (digests.find(d, hash)) return hash;
+				imghash::Input input(data, size);
+				hash = h.apply(load(input, p));
+				digests.insert(d, hash);
+				return hash;
+			};
+
+			auto output = [&](const std::vector<uint8_t>& hash, const std::string& file, [[maybe_unused]] const std::optional<imghash::Digest>& d, bool cached) {
+				imghash::FileInfo info;
+				if (stat_files) {
+					std::lock_guard<std::mutex> lock(infos_mutex);
+					auto i = infos.find(file);
+					if (i != infos.end()) {
+						info = i->second;
+						infos.erase(i);
+					}
+				}
+				if (cache && !cached) cache->add(file, info, hash);
+				#ifdef USE_SQLITE
+				imghash::Database::entry e;
+				if (add) {
+					e.point = hash;
+					e.item = file;
+					e.info = info;
+					e.digest = d;
+					e.replace = update;
+				}
+				if (writer) {
+					writer->push(std::move(e));
+					return;
+				}
+				#endif
 				print_hash(std::cout, hash, file, binary, quiet);
 				#ifdef USE_SQLITE
 				if (db) {
-					if (add) db->insert(hash, file);
-					if (query_limit > 0) print_query(std::cout, db->query(hash, query_dist, query_limit));
+					if (add) db->insert(e);
+					if (query_limit > 0) print_query(std::cout, *db, hash, query_dist, query_limit, budget);
 				}
 				#endif
+			};
+
+			if (jobs <= 1) {
+				std::string file;
+				std::vector<uint8_t> cached;
+				while (paths.next(file)) {
+					if (check(file, cached)) continue;
+					if (!cached.empty()) {
+						output(cached, file, std::nullopt, true);
+						continue;
+					}
+					imghash::MappedFile mapped(file);
+					if (mapped.data()) {
+						imghash::Digest d;
+						auto hash = hash_file(mapped.data(), mapped.size(), prep, *hasher, d);
+						output(hash, file, d, false);
+					}
+					else {
+						//not a regular file, so it can't be digested before it's read
+						imghash::Image<float> img = load(file, prep);
+						output(hasher->apply(img), file, std::nullopt, false);
+					}
+				}
+			}
+			else {
+				//each worker gets its own Preprocess and Hasher
+				std::vector<imghash::Preprocess> preps;
+				std::vector<std::unique_ptr<imghash::Hasher>> hashers;
+				for (size_t i = 0; i < jobs; ++i) {
+					preps.emplace_back(128, 128);
+					hashers.push_back(make_hasher());
+				}
+
+				//the hashes are output (and added to the database) in order
+				// so at most `window` files are in flight at once, bounding the memory held by out of order results
+				struct file_hash {
+					std::vector<uint8_t> hash;
+					std::string file;
+					std::optional<imghash::Digest> digest;
+					std::exception_ptr error;
+					bool cached = false;
+					bool end = false; // after the last file
+				};
+				const size_t window = std::max<size_t>(4 * jobs, 64);
+				imghash::ReorderBuffer<file_hash> results(window);
+
+				//files are read ahead on their own thread (many at once, on an io_uring where there is one),
+				// and each is decoded from memory by a worker once it's read
+				const size_t max_read_bytes = 128 << 20;
+				auto reader = imghash::FileReader::create(window, max_read_bytes, jobs);
+				//cached files keep their place in the order, but aren't read: their hashes wait here, by index
+				std::unordered_map<size_t, std::vector<uint8_t>> cached;
+				std::mutex cached_mutex;
+				size_t next_index = 0;
+				auto next = [&](std::string& path, bool& read) {
+					std::vector<uint8_t> hash;
+					while (paths.next(path)) {
+						if (check(path, hash)) continue;
+						if (!hash.empty()) {
+							read = false;
+							std::lock_guard<std::mutex> lock(cached_mutex);
+							cached.emplace(next_index, std::move(hash));
+						}
+						++next_index;
+						return true;
+					}
+					return false;
+				};
+				std::atomic<size_t> read_count(0);
+
+				//declared after everything its workers use, so that they are stopped first
+				imghash::ThreadPool pool(jobs);
+				auto done = [&](size_t i, const std::string& path, std::vector<uint8_t>&& data, std::exception_ptr error) {
+					++read_count;
+					{
+						std::lock_guard<std::mutex> lock(cached_mutex);
+						auto c = cached.find(i);
+						if (c != cached.end()) {
+							file_hash res;
+							res.hash = std::move(c->second);
+							res.file = path;
+							res.error = error;
+							res.cached = true;
+							cached.erase(c);
+							results.put(i, std::move(res));
+							return;
+						}
+					}
+					pool.submit([&, i, path, data = std::move(data), error]() {
+						auto w = pool.worker_index();
+						file_hash res;
+						res.file = path;
+						res.error = error;
+						if (!res.error) {
+							try {
+								imghash::Digest d;
+								res.hash = hash_file(data.data(), data.size(), preps[w], *hashers[w], d);
+								res.digest = d;
+							}
+							catch (...) {
+								res.error = std::current_exception();
+							}
+						}
+						results.put(i, std::move(res));
+					});
+				};
+				std::thread read_thread([&]() {
+					file_hash end;
+					end.end = true;
+					try {
+						reader->read(next, done);
+					}
+					catch (...) {
+						//e.g. a directory that can't be read, output after the files before it
+						end.error = std::current_exception();
+					}
+					if (results.reserve(read_count)) results.put(read_count, std::move(end));
+				});
+				//stop finding and reading files, and wait for the files in flight, before the pool goes
+				struct read_guard {
+					imghash::PathSource& paths;
+					imghash::FileReader& reader;
+					imghash::ReorderBuffer<file_hash>& results;
+					std::thread& thread;
+					~read_guard() {
+						paths.cancel();
+						reader.cancel();
+						results.cancel();
+						thread.join();
+					}
+				} guard{ paths, *reader, results, read_thread };
+
+				for (size_t i = 0; ; ++i) {
+					auto res = results.take();
+					if (res.error) std::rethrow_exception(res.error);
+					if (res.end) break;
+					reader->release(i);
+					output(res.hash, res.file, res.digest, res.cached);
+				}
 			}
 		}
+#ifdef USE_SQLITE
+		if (writer) writer->finish();
+#endif
 	}
 	catch (std::exception& e) {
 		std::cerr << "Error: " << e.what() << std::endl;
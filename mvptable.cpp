@@ -1,9 +1,12 @@
 
 #include "mvptable.h"
+#include "threadpool.h"
 #include <sqlite3.h>
 #include <cmath>
 #include <algorithm>
 #include <cassert>
+#include <map>
+#include <exception>
 
 SQLStatementCache::SQLStatementCache() : db(nullptr)
 {
@@ -169,16 +172,38 @@ void MVPTable::check_db() {
 }
 
 MVPTable::MVPTable()
-	: db(nullptr), cache(nullptr)
+	: db(nullptr), cache(nullptr), keyed(false), packed(false)
 {
 	//nothing else to do
 }
 
 // Construct, open or create the database
-MVPTable::MVPTable(std::shared_ptr<SQLite::Database> db, std::function<distance_fn> dist_fn) 
-	: db(db), cache(db)
+MVPTable::MVPTable(std::shared_ptr<SQLite::Database> db, std::function<distance_fn> dist_fn,
+	std::function<batch_distance_fn> batch_dist_fn, std::function<key_distance_fn> key_dist_fn, bool read_only,
+	const layout_options& layout)
+	: db(db), cache(db), batch_dist_fn(std::move(batch_dist_fn)), keyed(false), packed(false)
 {
 	if (db == nullptr) return;
+
+	set_dist_fn(dist_fn);
+	if (key_dist_fn) set_key_dist_fn(key_dist_fn);
+	db->createFunction("mvp_distance", 2, true, nullptr, MVPTable::sql_distance);
+	db->createFunction("mvp_key", 1, true, nullptr, MVPTable::sql_key);
+	db->createFunction("mvp_key_distance", 2, true, nullptr, MVPTable::sql_key_distance);
+	db->createFunction("mvp_unpack", 2, true, nullptr, MVPTable::sql_unpack);
+	db->createFunction("mvp_pack", 3, true, nullptr, MVPTable::sql_pack);
+
+	//an existing table keeps the layout it was created with
+	bool has_points = false;
+	SQLite::Statement columns(*db, "PRAGMA table_info(mvp_points);");
+	while (columns.executeStep()) {
+		has_points = true;
+		auto name = columns.getColumn("name").getString();
+		if (name == "dists") packed = true;
+		if (name == "key") keyed = true;
+	}
+	if (read_only) return;
+	if (!has_points) packed = layout.packed;
 	
 	//initialize database as necessary
 	db->exec(
@@ -196,12 +221,55 @@ MVPTable::MVPTable(std::shared_ptr<SQLite::Database> db, std::function<distance_
 		//  shell(value, id) is the index of which shell around the vantage point the value falls in
 		"partition INTEGER,"
 		//TODO: if the value blobs are big, it might be wise to add a hash for quick lookup?
-		"value BLOB"
+		"value BLOB,"
+		//the value as an integer if it's 8 bytes (see point_key), otherwise NULL
+		"key INTEGER" + std::string(packed ?
+		//the distance to each vantage point, as uint16 at vp_index(id), little endian
+		",dists BLOB" :
 		// "d0 INTEGER," etc are added later for each vantage_point with an ALTER TABLE
+		"") +
 		");"
-		"CREATE INDEX IF NOT EXISTS mvp_idx_points_part ON mvp_points(partition);"
-		"CREATE UNIQUE INDEX IF NOT EXISTS mvp_idx_points_value ON mvp_points(value);"
 	);
+	//clustered, the index by partition holds the values too, so the points of a partition are read from
+	// one run of index pages, in the order they're stored, rather than looked up one by one in the table
+	// it replaces the plain index by partition, and once added (to a new table or an existing one) stays
+	bool clustered = layout.clustered
+		|| db->execAndGet("SELECT COUNT(1) FROM sqlite_master WHERE type = 'index' AND name = 'mvp_idx_points_part_value';").getInt64() > 0;
+	if (has_points && !keyed) {
+		//tables from before the keys get them, and their indexes on value are made again to suit
+		db->exec(
+			"ALTER TABLE mvp_points ADD COLUMN key INTEGER;"
+			"UPDATE mvp_points SET key = mvp_key(value);"
+			"DROP INDEX IF EXISTS mvp_idx_points_value;"
+			"DROP INDEX IF EXISTS mvp_idx_points_part_value;"
+		);
+	}
+	keyed = true;
+	//points are unique by key if they have one, and by value if they don't
+	db->exec(
+		"CREATE UNIQUE INDEX IF NOT EXISTS mvp_idx_points_key ON mvp_points(key) WHERE key IS NOT NULL;"
+		"CREATE UNIQUE INDEX IF NOT EXISTS mvp_idx_points_value ON mvp_points(value) WHERE key IS NULL;"
+	);
+	if (clustered) {
+		db->exec(
+			"CREATE INDEX IF NOT EXISTS mvp_idx_points_part_value ON mvp_points(partition, value, key);"
+			"DROP INDEX IF EXISTS mvp_idx_points_part;"
+		);
+	}
+	else {
+		db->exec("CREATE INDEX IF NOT EXISTS mvp_idx_points_part ON mvp_points(partition);");
+	}
+	if (packed) {
+		db->exec(
+			"CREATE TABLE IF NOT EXISTS mvp_partitions ("
+			"partition INTEGER PRIMARY KEY,"
+			"count INTEGER,"
+			//the min and max distances of the partition's points to each vantage point, packed as dists
+			"min_dists BLOB,"
+			"max_dists BLOB"
+			");"
+		);
+	}
 	db->exec(
 		"CREATE TABLE IF NOT EXISTS mvp_vantage_points ("
 		"id INTEGER PRIMARY KEY,"
@@ -216,13 +284,6 @@ MVPTable::MVPTable(std::shared_ptr<SQLite::Database> db, std::function<distance_
 		"value BLOB UNIQUE" // not necessarily in mvp_points
 		");"
 	);
-	db->exec(
-		"CREATE TEMPORARY TABLE mvp_query ("
-			"id INTEGER PRIMARY KEY,"
-			"dist INTEGER" //distance to query point
-		");"
-	);
-	
 	//if counts is empty, initialize it
 	if (db->execAndGet("SELECT COUNT(1) FROM mvp_counts").getInt64() == 0) {
 		auto num_points = db->execAndGet("SELECT COUNT(1) FROM mvp_points").getInt64();
@@ -237,18 +298,116 @@ MVPTable::MVPTable(std::shared_ptr<SQLite::Database> db, std::function<distance_
 		ins_counts.bind("$vantage_points", num_vantage_points);
 		ins_counts.exec();
 	}
-	
-	set_dist_fn(std::move(dist_fn));
-	db->createFunction("mvp_distance", 2, true, nullptr, MVPTable::sql_distance);
+}
+
+MVPTable::~MVPTable()
+{
+	//the pool goes first, as its workers use the readers
+	pool.reset();
+}
+
+void MVPTable::open_readers(const std::string& path, size_t n)
+{
+	pool.reset();
+	readers.clear();
+	if (n <= 1) return;
+
+	for (size_t i = 0; i < n; ++i) {
+		Reader r;
+		r.db = std::make_unique<SQLite::Database>(path, SQLite::OPEN_READONLY);
+		r.db->createFunction("mvp_distance", 2, true, nullptr, MVPTable::sql_distance);
+		r.db->createFunction("mvp_key_distance", 2, true, nullptr, MVPTable::sql_key_distance);
+		r.sel_part = std::make_unique<SQLite::Statement>(*r.db, str_sel_part());
+		readers.push_back(std::move(r));
+	}
+	pool = std::make_unique<imghash::ThreadPool>(n);
 }
 
 std::function<MVPTable::distance_fn> MVPTable::dist_fn;
+std::function<MVPTable::key_distance_fn> MVPTable::key_dist_fn;
 
 void MVPTable::set_dist_fn(std::function<distance_fn> df)
 {
 	dist_fn = std::move(df);
 }
 
+void MVPTable::set_key_dist_fn(std::function<key_distance_fn> df)
+{
+	key_dist_fn = std::move(df);
+}
+
+bool MVPTable::point_key(const uint8_t* value, size_t size, int64_t& key)
+{
+	if (size != 8) return false;
+	uint64_t k = 0;
+	for (size_t i = 8; i > 0; --i) k = (k << 8) | value[i - 1];
+	key = static_cast<int64_t>(k);
+	return true;
+}
+
+void MVPTable::sql_key(sqlite3_context* ctx, int n, sqlite3_value* args[])
+{
+	if (n != 1) {
+		sqlite3_result_error(ctx, "mvp_key requires 1 argument.", -1);
+		return;
+	}
+	int64_t key;
+	if (point_key(static_cast<const uint8_t*>(sqlite3_value_blob(args[0])), sqlite3_value_bytes(args[0]), key)) {
+		sqlite3_result_int64(ctx, key);
+	}
+	else {
+		sqlite3_result_null(ctx);
+	}
+}
+
+void MVPTable::sql_key_distance(sqlite3_context* ctx, int n, sqlite3_value* args[])
+{
+	if (n != 2) {
+		sqlite3_result_error(ctx, "mvp_key_distance requires 2 arguments.", -1);
+		return;
+	}
+	//NULL unless both points have keys, so the caller can fall back to mvp_distance
+	if (!key_dist_fn || sqlite3_value_type(args[0]) == SQLITE_NULL || sqlite3_value_type(args[1]) == SQLITE_NULL) {
+		sqlite3_result_null(ctx);
+		return;
+	}
+	sqlite3_result_int(ctx, key_dist_fn(sqlite3_value_int64(args[0]), sqlite3_value_int64(args[1])));
+}
+
+std::string MVPTable::str_sel_part() const
+{
+	//the distance of points with keys takes two integers rather than two blobs
+	return keyed ?
+		"SELECT id, COALESCE(mvp_key_distance($q_key, key), mvp_distance($q_value, value)) AS dist "
+		"FROM mvp_points WHERE partition = $partition LIMIT $limit;" :
+		"SELECT id, mvp_distance($q_value, value) AS dist "
+		"FROM mvp_points WHERE partition = $partition LIMIT $limit;";
+}
+
+void MVPTable::bind_query(SQLite::Statement& sel_part, const blob_type& q_value)
+{
+	sel_part.bind("$q_value", q_value.data(), static_cast<int>(q_value.size()));
+	if (!keyed) return;
+	int64_t key;
+	if (point_key(q_value.data(), q_value.size(), key)) sel_part.bind("$q_key", key);
+	else sel_part.bind("$q_key");
+}
+
+bool MVPTable::find_point(const blob_type& value, int64_t& id)
+{
+	check_db();
+	int64_t key;
+	bool has_key = keyed && point_key(value.data(), value.size(), key);
+	auto& sel_pt = has_key ? cache["SELECT id FROM mvp_points WHERE key = $key;"]
+		: cache[keyed ? "SELECT id FROM mvp_points WHERE value = $value AND key IS NULL;" : "SELECT id FROM mvp_points WHERE value = $value;"];
+	if (has_key) sel_pt.bind("$key", key);
+	else sel_pt.bind("$value", value.data(), static_cast<int>(value.size()));
+	bool found = sel_pt.executeStep();
+	if (found) id = sel_pt.getColumn(0).getInt64();
+	sel_pt.reset();
+	return found;
+}
+
 void MVPTable::sql_distance(sqlite3_context* ctx, int n, sqlite3_value* args[])
 {
 	if (n != 2) {
@@ -261,9 +420,49 @@ void MVPTable::sql_distance(sqlite3_context* ctx, int n, sqlite3_value* args[])
 	sqlite3_result_int(ctx, d);
 }
 
+void MVPTable::sql_unpack(sqlite3_context* ctx, int n, sqlite3_value* args[])
+{
+	if (n != 2) {
+		sqlite3_result_error(ctx, "mvp_unpack requires 2 arguments.", -1);
+		return;
+	}
+	auto size = static_cast<size_t>(sqlite3_value_bytes(args[0]));
+	auto i = static_cast<size_t>(sqlite3_value_int64(args[1]));
+	if (2 * i + 2 > size) {
+		sqlite3_result_null(ctx);
+		return;
+	}
+	sqlite3_result_int(ctx, unpack(static_cast<const uint8_t*>(sqlite3_value_blob(args[0])), size, i));
+}
+
+void MVPTable::sql_pack(sqlite3_context* ctx, int n, sqlite3_value* args[])
+{
+	if (n != 3) {
+		sqlite3_result_error(ctx, "mvp_pack requires 3 arguments.", -1);
+		return;
+	}
+	auto dists = get_blob(args[0]);
+	pack(dists, static_cast<size_t>(sqlite3_value_int64(args[1])), sqlite3_value_int(args[2]));
+	sqlite3_result_blob(ctx, dists.data(), static_cast<int>(dists.size()), SQLITE_TRANSIENT);
+}
+
+uint16_t MVPTable::unpack(const uint8_t* dists, size_t size, size_t i)
+{
+	if (2 * i + 2 > size) return 0;
+	return static_cast<uint16_t>(dists[2 * i] | (dists[2 * i + 1] << 8));
+}
+
+void MVPTable::pack(blob_type& dists, size_t i, int32_t d)
+{
+	if (dists.size() < 2 * i + 2) dists.resize(2 * i + 2, 0);
+	auto v = static_cast<uint16_t>(std::clamp(d, 0, 0xffff));
+	dists[2 * i] = static_cast<uint8_t>(v);
+	dists[2 * i + 1] = static_cast<uint8_t>(v >> 8);
+}
+
 const std::string MVPTable::str_ins_point(const std::vector<int64_t>& vp_ids) {
-	std::string stmt1 = "INSERT INTO mvp_points(partition, value";
-	std::string stmt2 = ") VALUES ($partition, $value";
+	std::string stmt1 = "INSERT INTO mvp_points(partition, value, key";
+	std::string stmt2 = ") VALUES ($partition, $value, $key";
 	for (int64_t id : vp_ids) {
 		auto id_str = std::to_string(id);
 		stmt1 += ", d" + id_str;
@@ -272,15 +471,6 @@ const std::string MVPTable::str_ins_point(const std::vector<int64_t>& vp_ids) {
 	return stmt1 + stmt2 + ") RETURNING id;";
 }
 
-const std::string MVPTable::str_ins_query(const std::vector<int64_t>& vp_ids)
-{
-	return std::string(
-		"INSERT INTO mvp_query(id, dist) "
-		"SELECT id, mvp_distance($q_value, value) AS dist "
-		"FROM mvp_points WHERE partition = $partition AND dist <= $radius;"
-	);
-}
-
 MVPTable::blob_type MVPTable::get_blob(sqlite3_value* val)
 {
 	//TODO: error checking
@@ -299,12 +489,54 @@ MVPTable::blob_type MVPTable::get_blob(SQLite::Column& col)
 void MVPTable::update_vp_ids(const std::vector<int64_t>& vp_ids)
 {
 	if (!std::equal(vp_ids_.begin(), vp_ids_.end(), vp_ids.begin(), vp_ids.end())) {
-		ins_point = std::make_unique<SQLite::Statement>(*db, str_ins_point(vp_ids));
-		ins_query = std::make_unique<SQLite::Statement>(*db, str_ins_query(vp_ids));
+		ins_point.reset();
 		vp_ids_ = vp_ids;
 	}
 }
 
+void MVPTable::remove_point(int64_t id)
+{
+	check_db();
+
+	auto& sel_part = cache["SELECT partition FROM mvp_points WHERE id = $id;"];
+	sel_part.bind("$id", id);
+	if (!sel_part.executeStep()) {
+		sel_part.reset();
+		return;
+	}
+	auto part = sel_part.getColumn(0).getInt64();
+	sel_part.reset();
+
+	//the partition has the point's shell around each vantage point
+	auto& dec_count_0 = cache["UPDATE mvp_vantage_points SET count_0 = count_0 - 1 WHERE id = $id"];
+	auto& dec_count_1 = cache["UPDATE mvp_vantage_points SET count_1 = count_1 - 1 WHERE id = $id"];
+	auto& dec_count_2 = cache["UPDATE mvp_vantage_points SET count_2 = count_2 - 1 WHERE id = $id"];
+	auto& dec_count_3 = cache["UPDATE mvp_vantage_points SET count_3 = count_3 - 1 WHERE id = $id"];
+	for (auto vp_id : vantage_point_ids()) {
+		auto shell = (part >> partition_offset(vp_id)) & partition_mask();
+		auto& dec_count = shell == 3 ? dec_count_3 : shell == 2 ? dec_count_2 : shell == 1 ? dec_count_1 : dec_count_0;
+		dec_count.bind("$id", vp_id);
+		cache.exec(dec_count);
+	}
+
+	//a packed partition's summary is left as it is: it's still a bound on its points, if a looser one
+	auto& del_point = cache["DELETE FROM mvp_points WHERE id = $id;"];
+	del_point.bind("$id", id);
+	cache.exec(del_point);
+	cache.exec("UPDATE mvp_counts SET points = points - 1 WHERE id = 1;");
+}
+
+void MVPTable::recount()
+{
+	check_db();
+	cache.exec(
+		"UPDATE mvp_counts SET "
+			"points = (SELECT COUNT(1) FROM mvp_points),"
+			"vantage_points = (SELECT COUNT(1) FROM mvp_vantage_points) "
+			"WHERE id = 1;"
+	);
+}
+
 int64_t MVPTable::count_points() {
 	return cache.exec_getInt64("SELECT points FROM mvp_counts WHERE id = 1;", "points");
 }
@@ -318,16 +550,12 @@ int64_t MVPTable::insert_point(const blob_type& p_value)
  	check_db();
 
 	//is the point already in the database?
-	auto& sel_pt = cache["SELECT id FROM mvp_points WHERE value = $value;"];
-	sel_pt.bind("$value", p_value.data(), static_cast<int>(p_value.size()));
-	if (sel_pt.executeStep()) {
+	int64_t id, key;
+	if (find_point(p_value, id)) {
 		//yes
-		auto id = sel_pt.getColumn(0).getInt64();
-		sel_pt.reset();
 		return id;
 	}
 	else {
-		sel_pt.reset();
 		//no: we need to add the point
 
 		//iterate over the vantage points
@@ -394,18 +622,67 @@ int64_t MVPTable::insert_point(const blob_type& p_value)
 		}
 		sel_vps.reset();
 
+		if (packed) {
+			blob_type p_dists;
+			for (size_t i = 0; i < vp_ids.size(); ++i) pack(p_dists, vp_index(vp_ids[i]), dists[i]);
+
+			auto& ins = cache["INSERT INTO mvp_points(partition, value, key, dists) VALUES ($partition, $value, $key, $dists) RETURNING id;"];
+			ins.bind("$partition", part);
+			ins.bind("$value", p_value.data(), static_cast<int>(p_value.size()));
+			if (point_key(p_value.data(), p_value.size(), key)) ins.bind("$key", key);
+			else ins.bind("$key");
+			ins.bind("$dists", p_dists.data(), static_cast<int>(p_dists.size()));
+			if (!ins.executeStep()) {
+				throw std::runtime_error("Error inserting point");
+			}
+			id = ins.getColumn(0).getInt64();
+			ins.reset();
+			cache.exec("UPDATE mvp_counts SET points = points + 1 WHERE id = 1;");
+
+			//widen the partition's summary to take in the point
+			auto& sel_sum = cache["SELECT count, min_dists, max_dists FROM mvp_partitions WHERE partition = $partition;"];
+			sel_sum.bind("$partition", part);
+			int64_t count = 0;
+			blob_type min_dists = p_dists, max_dists = p_dists;
+			if (sel_sum.executeStep()) {
+				count = sel_sum.getColumn(0).getInt64();
+				auto min_col = sel_sum.getColumn(1);
+				auto max_col = sel_sum.getColumn(2);
+				auto min_data = static_cast<const uint8_t*>(min_col.getBlob());
+				auto max_data = static_cast<const uint8_t*>(max_col.getBlob());
+				for (size_t i = 0; 2 * i < p_dists.size(); ++i) {
+					if (2 * i + 2 > static_cast<size_t>(min_col.getBytes())) break;
+					auto d = unpack(p_dists.data(), p_dists.size(), i);
+					pack(min_dists, i, std::min(d, unpack(min_data, min_col.getBytes(), i)));
+					pack(max_dists, i, std::max(d, unpack(max_data, max_col.getBytes(), i)));
+				}
+			}
+			sel_sum.reset();
+
+			auto& upd_sum = cache["REPLACE INTO mvp_partitions(partition, count, min_dists, max_dists) VALUES ($partition, $count, $min, $max);"];
+			upd_sum.bind("$partition", part);
+			upd_sum.bind("$count", count + 1);
+			upd_sum.bind("$min", min_dists.data(), static_cast<int>(min_dists.size()));
+			upd_sum.bind("$max", max_dists.data(), static_cast<int>(max_dists.size()));
+			cache.exec(upd_sum);
+			return id;
+		}
+
 		//update the insert_point statement if vp_ids changed
 		update_vp_ids(vp_ids);
+		if (!ins_point) ins_point = std::make_unique<SQLite::Statement>(*db, str_ins_point(vp_ids_));
 
 		ins_point->bind("$partition", part);
 		ins_point->bind("$value", p_value.data(), static_cast<int>(p_value.size()));
+		if (point_key(p_value.data(), p_value.size(), key)) ins_point->bind("$key", key);
+		else ins_point->bind("$key");
 		for (int i = 0; i < dists.size(); ++i) {
-			ins_point->bind(i + 3, dists[i]); //the first parameter has index 1, so these start at 3
+			ins_point->bind(i + 4, dists[i]); //the first parameter has index 1, so these start at 4
 		}
 		if (ins_point->executeStep()) {
 			cache.exec("UPDATE mvp_counts SET points = points + 1 WHERE id = 1;");
 			
-			auto id = ins_point->getColumn(0).getInt64();
+			id = ins_point->getColumn(0).getInt64();
 			ins_point->reset();
 			return id;
 		}
@@ -449,15 +726,14 @@ int64_t MVPTable::insert_vantage_point(const blob_type& vp_value)
 	}
 
 	//2. add the new column of distances to mvp_points
-	std::string col_name = "d" + std::to_string(vp_id);
+	if (!packed) {
+		std::string col_name = "d" + std::to_string(vp_id);
 
-	db->exec("ALTER TABLE mvp_points ADD COLUMN " + col_name + " INTEGER;");
-	
-	db->exec("CREATE INDEX mvp_idx_" + col_name + " ON mvp_points(" + col_name + ");");
-	
-	auto upd_col = SQLite::Statement(*db, "UPDATE mvp_points SET " + col_name + " = mvp_distance($vp_value, value);");
-	upd_col.bind("$vp_value", vp_value.data(), static_cast<int>(vp_value.size()));
-	cache.exec(upd_col);
+		db->exec("ALTER TABLE mvp_points ADD COLUMN " + col_name + " INTEGER;");
+
+		db->exec("CREATE INDEX mvp_idx_" + col_name + " ON mvp_points(" + col_name + ");");
+	}
+	set_distances(vp_id, vp_value);
 
 	//3. balance the shells
 	balance(vp_id);
@@ -465,7 +741,22 @@ int64_t MVPTable::insert_vantage_point(const blob_type& vp_value)
 	return vp_id;
 }
 
-int64_t MVPTable::query(const blob_type& q_value, uint32_t radius)
+void MVPTable::set_distances(int64_t vp_id, const blob_type& vp_value)
+{
+	if (packed) {
+		auto& upd_dists = cache["UPDATE mvp_points SET dists = mvp_pack(dists, $index, mvp_distance($vp_value, value));"];
+		upd_dists.bind("$index", static_cast<int64_t>(vp_index(vp_id)));
+		upd_dists.bind("$vp_value", vp_value.data(), static_cast<int>(vp_value.size()));
+		cache.exec(upd_dists);
+	}
+	else {
+		auto upd_col = SQLite::Statement(*db, "UPDATE mvp_points SET d" + std::to_string(vp_id) + " = mvp_distance($vp_value, value);");
+		upd_col.bind("$vp_value", vp_value.data(), static_cast<int>(vp_value.size()));
+		cache.exec(upd_col);
+	}
+}
+
+std::vector<MVPTable::query_partition> MVPTable::query_partitions(const blob_type& q_value, uint32_t radius)
 {
 	check_db();
 
@@ -479,6 +770,9 @@ int64_t MVPTable::query(const blob_type& q_value, uint32_t radius)
 		"SELECT "
 			"id,"
 			"dist,"
+			"bound_1,"
+			"bound_2,"
+			"bound_3,"
 			"CASE WHEN dist + $rad >= bound_3 THEN 1 ELSE 0 END AS shell_3,"
 			"CASE WHEN bound_3 > bound_2 AND dist + $rad >= bound_2 AND dist - $rad < bound_3 THEN 1 ELSE 0 END AS shell_2,"
 			"CASE WHEN bound_2 > bound_1 AND dist + $rad >= bound_1 AND dist - $rad < bound_2 THEN 1 ELSE 0 END AS shell_1,"
@@ -487,27 +781,40 @@ int64_t MVPTable::query(const blob_type& q_value, uint32_t radius)
 	];
 
 	std::vector<int64_t> vp_ids;
-	std::vector<int64_t> parts;
-	parts.push_back(0); // which paritions the query ball covers
+	std::vector<int32_t> vp_dists; // by vp_index, for the partition summaries
+	std::vector<query_partition> parts;
+	parts.push_back({ 0, 0 }); // which paritions the query ball covers
 	
 	sel_vps.bind("$pt", q_value.data(), static_cast<int>(q_value.size()));
 	sel_vps.bind("$rad", radius);
 	while (sel_vps.executeStep()) {
 		auto id = sel_vps.getColumn("id").getInt64();
 		auto dist = sel_vps.getColumn("dist").getInt();
+		auto bound_1 = sel_vps.getColumn("bound_1").getInt();
+		auto bound_2 = sel_vps.getColumn("bound_2").getInt();
+		auto bound_3 = sel_vps.getColumn("bound_3").getInt();
 		auto shell_3 = sel_vps.getColumn("shell_3").getInt();
 		auto shell_2 = sel_vps.getColumn("shell_2").getInt();
 		auto shell_1 = sel_vps.getColumn("shell_1").getInt();
 		auto shell_0 = sel_vps.getColumn("shell_0").getInt();
 		
 		vp_ids.push_back(id);
+		if (vp_dists.size() <= vp_index(id)) vp_dists.resize(vp_index(id) + 1, -1);
+		vp_dists[vp_index(id)] = dist;
+
+		//the lower bound on the distance to any point in a shell, by the triangle inequality
+		// shell s holds the points with lower <= d < upper, so a point in it is
+		// at least (lower - dist) or (dist - (upper - 1)) from the query
+		auto shell_bound = [dist](int32_t lower, int32_t upper) {
+			return std::max({ 0, lower - dist, dist - (upper - 1) });
+		};
 
 		//TODO: I have no idea how this might be done in SQL
-		std::vector<int> shells;
-		if (shell_3 != 0) shells.push_back(3);
-		if (shell_2 != 0) shells.push_back(2);
-		if (shell_1 != 0) shells.push_back(1);
-		if (shell_0 != 0) shells.push_back(0);
+		std::vector<std::pair<int, int32_t>> shells;
+		if (shell_3 != 0) shells.emplace_back(3, std::max(0, bound_3 - dist));
+		if (shell_2 != 0) shells.emplace_back(2, shell_bound(bound_2, bound_3));
+		if (shell_1 != 0) shells.emplace_back(1, shell_bound(bound_1, bound_2));
+		if (shell_0 != 0) shells.emplace_back(0, shell_bound(0, bound_1));
 		if(shells.empty()) {
 			throw std::runtime_error("Error querying point: invalid shells");
 		}
@@ -515,41 +822,292 @@ int64_t MVPTable::query(const blob_type& q_value, uint32_t radius)
 		if (shells.size() == 1) {
 			//a single shell -- we can modify the existing partitions in place
 			for (auto& p : parts) {
-				p |= partition_bits(shells[0], id);
+				p.partition |= partition_bits(shells[0].first, id);
+				p.bound = std::max(p.bound, shells[0].second);
 			}
 		}
 		else {
 			//multple shells -- the number of partitions the query covers will grow
-			std::vector<int64_t> new_parts;
+			std::vector<query_partition> new_parts;
 			new_parts.reserve(parts.size() * shells.size());
-			for (auto p : parts) {
-				for (auto s : shells) {
-					new_parts.push_back(p | partition_bits(s, id));
+			for (const auto& p : parts) {
+				for (const auto& s : shells) {
+					new_parts.push_back({ p.partition | partition_bits(s.first, id), std::max(p.bound, s.second) });
 				}
 			}
 			parts = std::move(new_parts);
 		}
 	}
 	sel_vps.reset();
-	update_vp_ids(vp_ids);
-	
-	//populate the query table with the points covered by the partitions
-	// sort by the distance to the query point
 
-	//first clear the query table
-	cache.exec("DELETE FROM mvp_query;");
-	
-	// build the query 
-	ins_query->bind("$q_value", q_value.data(), static_cast<int>(q_value.size()));
-	ins_query->bind("$radius", radius);
-	//run the query for each partition that the radius covers
-	int64_t result_count = 0;
-	for (auto p : parts) {
-		ins_query->bind("$partition", p);
-		result_count += ins_query->exec();
-		ins_query->reset();
+	if (packed) apply_summaries(parts, vp_dists, radius);
+	else update_vp_ids(vp_ids);
+
+	std::stable_sort(parts.begin(), parts.end(),
+		[](const query_partition& a, const query_partition& b) { return a.bound < b.bound; });
+	return parts;
+}
+
+void MVPTable::apply_summaries(std::vector<query_partition>& parts, const std::vector<int32_t>& vp_dists, uint32_t radius)
+{
+	//a point with distance d to a vantage point that's dist from the query point is at least |dist - d| from it,
+	// so the points of a partition are at least as far as the nearest of their range of d to dist
+	auto& sel_sum = cache["SELECT min_dists, max_dists FROM mvp_partitions WHERE partition = $partition;"];
+	size_t kept = 0;
+	for (const auto& p : parts) {
+		sel_sum.bind("$partition", p.partition);
+		if (!sel_sum.executeStep()) {
+			//no points
+			sel_sum.reset();
+			continue;
+		}
+		auto min_col = sel_sum.getColumn(0);
+		auto max_col = sel_sum.getColumn(1);
+		auto min_data = static_cast<const uint8_t*>(min_col.getBlob());
+		auto max_data = static_cast<const uint8_t*>(max_col.getBlob());
+		size_t n = std::min<size_t>(min_col.getBytes(), max_col.getBytes()) / 2;
+		int32_t bound = p.bound;
+		for (size_t i = 0; i < n && i < vp_dists.size(); ++i) {
+			if (vp_dists[i] < 0) continue;
+			bound = std::max({ bound, unpack(min_data, min_col.getBytes(), i) - vp_dists[i],
+				vp_dists[i] - unpack(max_data, max_col.getBytes(), i) });
+		}
+		sel_sum.reset();
+		if (static_cast<uint32_t>(bound) <= radius) parts[kept++] = { p.partition, bound };
+	}
+	parts.resize(kept);
+}
+
+void MVPTable::update_summaries()
+{
+	struct summary {
+		int64_t count = 0;
+		blob_type min_dists, max_dists;
+	};
+	std::map<int64_t, summary> summaries;
+
+	auto& sel_points = cache["SELECT partition, dists FROM mvp_points;"];
+	while (sel_points.executeStep()) {
+		auto& s = summaries[sel_points.getColumn(0).getInt64()];
+		auto col = sel_points.getColumn(1);
+		auto data = static_cast<const uint8_t*>(col.getBlob());
+		size_t size = col.getBytes();
+		if (s.count++ == 0) {
+			s.min_dists.assign(data, data + size);
+			s.max_dists.assign(data, data + size);
+			continue;
+		}
+		for (size_t i = 0; 2 * i + 2 <= size; ++i) {
+			auto d = unpack(data, size, i);
+			pack(s.min_dists, i, std::min(d, unpack(s.min_dists.data(), s.min_dists.size(), i)));
+			pack(s.max_dists, i, std::max(d, unpack(s.max_dists.data(), s.max_dists.size(), i)));
+		}
 	}
-	return result_count;
+	sel_points.reset();
+
+	cache.exec("DELETE FROM mvp_partitions;");
+	auto& ins_sum = cache["INSERT INTO mvp_partitions(partition, count, min_dists, max_dists) VALUES ($partition, $count, $min, $max);"];
+	for (const auto& s : summaries) {
+		ins_sum.bind("$partition", s.first);
+		ins_sum.bind("$count", s.second.count);
+		ins_sum.bind("$min", s.second.min_dists.data(), static_cast<int>(s.second.min_dists.size()));
+		ins_sum.bind("$max", s.second.max_dists.data(), static_cast<int>(s.second.max_dists.size()));
+		cache.exec(ins_sum);
+	}
+}
+
+MVPTable::query_stats MVPTable::query(const blob_type& q_value, uint32_t radius, const std::function<query_fn>& callback,
+	const query_budget& budget)
+{
+	auto parts = query_partitions(q_value, radius);
+
+	query_stats stats;
+	stats.partitions = static_cast<int64_t>(parts.size());
+
+	auto& sel_part = cache[str_sel_part()];
+	bind_query(sel_part, q_value);
+
+	//with readers, the partitions are scanned a wave at a time, one per reader, and handed to callback in order
+	// a budget of points needs the count of the partitions before, so it's scanned one by one
+	bool parallel = pool && budget.points == 0;
+	std::vector<std::vector<query_point>> wave;
+	std::vector<int64_t> wave_scanned;
+	size_t wave_start = 0;
+
+	//run the query for each partition that the radius covers, nearest first
+	std::vector<query_point> points;
+	for (size_t i = 0; i < parts.size(); ++i) {
+		if (parallel) {
+			if (i == wave_start + wave.size()) {
+				size_t n = std::min(readers.size(), parts.size() - i);
+				if (budget.partitions > 0) n = std::min<size_t>(n, static_cast<size_t>(budget.partitions - stats.partitions_scanned));
+				wave_start = i;
+				wave.assign(n, {});
+				wave_scanned.assign(n, 0);
+				std::vector<std::exception_ptr> errors(n);
+				for (size_t k = 0; k < n; ++k) {
+					pool->submit([&, k]() {
+						try {
+							auto& sel = *readers[pool->worker_index()].sel_part;
+							bind_query(sel, q_value);
+							wave_scanned[k] = scan_partition(sel, parts[wave_start + k].partition, radius, -1, wave[k]);
+						}
+						catch (...) {
+							errors[k] = std::current_exception();
+						}
+					});
+				}
+				pool->wait();
+				for (auto& e : errors) {
+					if (e) std::rethrow_exception(e);
+				}
+			}
+			points = std::move(wave[i - wave_start]);
+			stats.points_scanned += wave_scanned[i - wave_start];
+		}
+		else {
+			int64_t limit = -1; //no limit
+			if (budget.points > 0) limit = budget.points - stats.points_scanned;
+
+			points.clear();
+			auto scanned = scan_partition(sel_part, parts[i].partition, radius, limit, points);
+			stats.points_scanned += scanned;
+			//the budget may run out part way through the partition, even the last one
+			if (limit >= 0 && scanned == limit) stats.complete = false;
+		}
+		++stats.partitions_scanned;
+		stats.results += points.size();
+
+		//every point in the remaining partitions is at least as far as the next one's bound
+		int32_t bound = static_cast<int32_t>(radius) + 1;
+		if (i + 1 < parts.size()) {
+			if ((budget.points > 0 && stats.points_scanned >= budget.points)
+				|| (budget.partitions > 0 && stats.partitions_scanned >= budget.partitions))
+			{
+				//out of budget, whatever we found is all we'll get
+				stats.complete = false;
+				callback(points, bound);
+				break;
+			}
+			bound = parts[i + 1].bound;
+		}
+		if (!callback(points, bound)) break;
+	}
+	return stats;
+}
+
+int64_t MVPTable::scan_partition(SQLite::Statement& sel_part, int64_t partition, uint32_t radius, int64_t limit,
+	std::vector<query_point>& points)
+{
+	//the radius is checked here rather than in SQL so that each row is one distance evaluation
+	int64_t scanned = 0;
+	sel_part.bind("$partition", partition);
+	sel_part.bind("$limit", limit);
+	while (sel_part.executeStep()) {
+		++scanned;
+		auto dist = sel_part.getColumn(1).getInt();
+		if (dist >= 0 && static_cast<uint32_t>(dist) <= radius) {
+			points.push_back({ sel_part.getColumn(0).getInt64(), dist });
+		}
+	}
+	sel_part.reset();
+	return scanned;
+}
+
+std::vector<std::vector<MVPTable::query_point>> MVPTable::query_batch(const std::vector<blob_type>& q_values, uint32_t radius)
+{
+	std::vector<std::vector<query_point>> results(q_values.size());
+	if (q_values.empty()) return results;
+
+	size_t stride = q_values[0].size();
+	for (const auto& q : q_values) {
+		if (q.size() != stride) throw std::runtime_error("Error querying batch: points must be the same size");
+	}
+
+	//which queries cover each partition
+	std::map<int64_t, std::vector<size_t>> coverage;
+	for (size_t i = 0; i < q_values.size(); ++i) {
+		for (const auto& p : query_partitions(q_values[i], radius)) {
+			coverage[p.partition].push_back(i);
+		}
+	}
+
+	auto& sel_part = cache["SELECT id, value FROM mvp_points WHERE partition = $partition;"];
+
+	blob_type packed, value;
+	std::vector<uint32_t> dists;
+	for (const auto& cover : coverage) {
+		const auto& qs = cover.second;
+		//pack the queries so that each point can be compared against all of them at once
+		packed.clear();
+		for (auto q : qs) packed.insert(packed.end(), q_values[q].begin(), q_values[q].end());
+		dists.resize(qs.size());
+
+		sel_part.bind("$partition", cover.first);
+		while (sel_part.executeStep()) {
+			auto id = sel_part.getColumn(0).getInt64();
+			auto col = sel_part.getColumn(1);
+			const uint8_t* data = static_cast<const uint8_t*>(col.getBlob());
+			value.assign(data, data + col.getBytes());
+			if (batch_dist_fn) {
+				batch_dist_fn(value, packed, stride, dists.data());
+			}
+			else {
+				for (size_t k = 0; k < qs.size(); ++k) {
+					dists[k] = static_cast<uint32_t>(dist_fn(value, q_values[qs[k]]));
+				}
+			}
+			for (size_t k = 0; k < qs.size(); ++k) {
+				if (dists[k] <= radius) {
+					results[qs[k]].push_back({ id, static_cast<int32_t>(dists[k]) });
+				}
+			}
+		}
+		sel_part.reset();
+	}
+	return results;
+}
+
+std::vector<MVPTable::query_point> MVPTable::query_scan(const blob_type& q_value, const blob_type& coarse, uint32_t radius,
+	const query_budget& budget, query_stats& stats)
+{
+	check_db();
+
+	auto distance = [this](const blob_type& p, const blob_type& q) {
+		if (batch_dist_fn) {
+			uint32_t d;
+			batch_dist_fn(p, q, q.size(), &d);
+			return d;
+		}
+		return static_cast<uint32_t>(dist_fn(p, q));
+	};
+
+	auto& sel_points = cache["SELECT id, value FROM mvp_points LIMIT $limit;"];
+	sel_points.bind("$limit", budget.points > 0 ? budget.points : -1);
+
+	//if the coarse value is the whole query, its distance is the point's
+	bool whole = coarse.size() == q_value.size();
+	stats = query_stats();
+	stats.partitions = 1;
+	std::vector<query_point> results;
+	blob_type value;
+	while (sel_points.executeStep()) {
+		++stats.points_scanned;
+		auto col = sel_points.getColumn(1);
+		const uint8_t* data = static_cast<const uint8_t*>(col.getBlob());
+		value.assign(data, data + col.getBytes());
+		auto d = distance(value, coarse);
+		if (d > radius) continue;
+		if (!whole) d = distance(value, q_value);
+		if (d <= radius) {
+			results.push_back({ sel_points.getColumn(0).getInt64(), static_cast<int32_t>(d) });
+		}
+	}
+	sel_points.reset();
+	stats.partitions_scanned = 1;
+	stats.results = static_cast<int64_t>(results.size());
+	if (budget.points > 0 && stats.points_scanned >= budget.points) stats.complete = false;
+	return results;
 }
 
 MVPTable::blob_type MVPTable::find_vantage_point(size_t sample_size)
@@ -583,7 +1141,7 @@ MVPTable::blob_type MVPTable::find_vantage_point(size_t sample_size)
 			//we have few points, so do the pairwise distance between all
 			return cache.exec_getBlob(
 				"SELECT value FROM ("
-				"SELECT p.value AS value, sum(mvp_distance(p.value, q.value)) AS sum_dist"
+				"SELECT p.value AS value, sum(mvp_distance(p.value, q.value)) AS sum_dist "
 				"FROM mvp_points p, mvp_points q GROUP BY p.id"
 				") ORDER BY sum_dist DESC LIMIT 1;", "value");
 		}
@@ -591,9 +1149,9 @@ MVPTable::blob_type MVPTable::find_vantage_point(size_t sample_size)
 			//subsample the points, then do the pairwise distance between them
 			// NB this method of sampling is not very efficient -- it still touches all of the points
 			// TODO: more efficient random sampling?
-			auto& stmt = cache["WITH sampled_points AS (SELECT value FROM mvp_points ORDER BY random() LIMIT $sample_size) "
+			auto& stmt = cache["WITH sampled_points AS (SELECT id, value FROM mvp_points ORDER BY random() LIMIT $sample_size) "
 				"SELECT value FROM ("
-				"SELECT p.value AS value, sum(mvp_distance(p.value, q.value)) AS sum_dist"
+				"SELECT p.value AS value, sum(mvp_distance(p.value, q.value)) AS sum_dist "
 				"FROM sampled_points p, sampled_points q GROUP BY p.id"
 				") ORDER BY sum_dist DESC LIMIT 1;"];
 			stmt.bind("$sample_size", static_cast<int64_t>(sample_size));
@@ -632,7 +1190,7 @@ std::vector<int64_t> MVPTable::check_balance(int64_t min_count, float threshold)
 
 void MVPTable::balance(int64_t vp_id)
 {
-	std::string col_name = "d" + std::to_string(vp_id);
+	std::string col_name = packed ? "mvp_unpack(dists, " + std::to_string(vp_index(vp_id)) + ")" : "d" + std::to_string(vp_id);
 
 	//3. choose the shell boundaries so that they're balanced
 	//   we want to find the 25%, 50%, and 75% ranked distances
@@ -645,17 +1203,44 @@ void MVPTable::balance(int64_t vp_id)
 		auto rank_25 = point_count / 4;
 		auto rank_50 = point_count / 2;
 		auto rank_75 = rank_50 + rank_25;
-		auto find_bound = SQLite::Statement(*db,
-			"SELECT " + col_name + " FROM mvp_points ORDER BY " + col_name + " LIMIT 1 OFFSET $rank;"
-		);
-		find_bound.bind("$rank", rank_25);
-		bound_1 = cache.exec_getInt(find_bound, 0);
+		if (packed) {
+			//there's no index to rank the distances by, but they're small integers, so they're counted instead
+			std::vector<int64_t> counts;
+			auto& sel_dists = cache["SELECT mvp_unpack(dists, $index) FROM mvp_points;"];
+			sel_dists.bind("$index", static_cast<int64_t>(vp_index(vp_id)));
+			while (sel_dists.executeStep()) {
+				auto d = static_cast<size_t>(sel_dists.getColumn(0).getInt());
+				if (d >= counts.size()) counts.resize(d + 1, 0);
+				++counts[d];
+			}
+			sel_dists.reset();
+
+			//the distance at rank, as with ORDER BY LIMIT 1 OFFSET rank
+			auto find_bound = [&](int64_t rank) {
+				int64_t seen = 0;
+				for (size_t d = 0; d < counts.size(); ++d) {
+					seen += counts[d];
+					if (seen > rank) return static_cast<int32_t>(d);
+				}
+				throw std::runtime_error("Error executing statement");
+			};
+			bound_1 = find_bound(rank_25);
+			bound_2 = find_bound(rank_50);
+			bound_3 = find_bound(rank_75);
+		}
+		else {
+			auto find_bound = SQLite::Statement(*db,
+				"SELECT " + col_name + " FROM mvp_points ORDER BY " + col_name + " LIMIT 1 OFFSET $rank;"
+			);
+			find_bound.bind("$rank", rank_25);
+			bound_1 = cache.exec_getInt(find_bound, 0);
 
-		find_bound.bind("$rank", rank_50);
-		bound_2 = cache.exec_getInt(find_bound, 0);
+			find_bound.bind("$rank", rank_50);
+			bound_2 = cache.exec_getInt(find_bound, 0);
 
-		find_bound.bind("$rank", rank_75);
-		bound_3 = cache.exec_getInt(find_bound, 0);
+			find_bound.bind("$rank", rank_75);
+			bound_3 = cache.exec_getInt(find_bound, 0);
+		}
 
 		// the shells include the lower bound, but exclude the upper
 		// so the number of points is the difference between ranks
@@ -708,6 +1293,63 @@ void MVPTable::balance(int64_t vp_id)
 	upd_points_part.bind("$b2", bound_2);
 	upd_points_part.bind("$b3", bound_3);
 	cache.exec(upd_points_part);
+
+	if (packed) update_summaries();
+}
+
+std::vector<int64_t> MVPTable::vantage_point_ids()
+{
+	std::vector<int64_t> ids;
+	auto& sel_vps = cache["SELECT id FROM mvp_vantage_points ORDER BY id ASC;"];
+	while (sel_vps.executeStep()) {
+		ids.push_back(sel_vps.getColumn(0).getInt64());
+	}
+	sel_vps.reset();
+	return ids;
+}
+
+bool MVPTable::is_degraded(int64_t vp_id, int64_t min_count, float threshold)
+{
+	auto np = count_points();
+	if (np < min_count) return false;
+
+	//as check_balance, but with the points counted by the shell their partition puts them in
+	auto low = np * (1.0 - threshold) / 4;
+	auto high = np * (1.0 + threshold) / 4;
+	int64_t counts[4] = { 0, 0, 0, 0 };
+	auto& sel_shells = cache[
+		"SELECT (partition >> $part_off) & 3 AS shell, COUNT(1) FROM mvp_points GROUP BY shell;"
+	];
+	sel_shells.bind("$part_off", partition_offset(vp_id));
+	while (sel_shells.executeStep()) {
+		counts[sel_shells.getColumn(0).getInt() & 3] = sel_shells.getColumn(1).getInt64();
+	}
+	sel_shells.reset();
+	for (auto count : counts) {
+		if (count < low || count > high) return true;
+	}
+	return false;
+}
+
+bool MVPTable::reselect_vantage_point(int64_t vp_id)
+{
+	check_db();
+	auto vp_value = find_vantage_point(25);
+
+	auto& sel_vp = cache["SELECT id FROM mvp_vantage_points WHERE value = $value;"];
+	sel_vp.bind("$value", vp_value.data(), static_cast<int>(vp_value.size()));
+	bool exists = sel_vp.executeStep();
+	sel_vp.reset();
+	if (exists) return false;
+
+	auto& upd_vp = cache["UPDATE mvp_vantage_points SET value = $value WHERE id = $id;"];
+	upd_vp.bind("$value", vp_value.data(), static_cast<int>(vp_value.size()));
+	upd_vp.bind("$id", vp_id);
+	cache.exec(upd_vp);
+
+	set_distances(vp_id, vp_value);
+	balance(vp_id);
+	return true;
 }
 
 void MVPTable::auto_balance(int64_t min_count, float threshold) 
@@ -8,6 +8,10 @@
 #include <cstdint>
 #include <functional>
 
+namespace imghash {
+	class ThreadPool;
+}
+
 class SQLStatementCache
 {
 	//The database connection
@@ -61,12 +65,78 @@ class MVPTable
 public:
 	using blob_type = std::vector<uint8_t>;
 	using distance_fn = int32_t (const blob_type&, const blob_type&);
+	// distance from p to each of the values packed end to end in qs, each stride bytes long
+	using batch_distance_fn = void (const blob_type& p, const blob_type& qs, size_t stride, uint32_t* out);
+	// distance between the keys of two 8 byte values (see point_key), as dist_fn would find between the values
+	using key_distance_fn = int32_t (int64_t, int64_t);
+
+	// A point found by a query, and its distance to the query point
+	struct query_point {
+		int64_t id;
+		int32_t dist;
+	};
+
+	// A partition covered by a query, and a lower bound on the distance
+	// from the query point to any point in the partition
+	struct query_partition {
+		int64_t partition;
+		int32_t bound;
+	};
+
+	// Called by query with the points found in each partition, and a lower bound on
+	// the distance to every point that has not been visited yet
+	// Return false to stop the query
+	using query_fn = bool (const std::vector<query_point>& points, int32_t bound);
+
+	// Limits on the work done by an approximate query, zero means no limit
+	struct query_budget {
+		int64_t partitions; // the number of partitions to scan
+		int64_t points; // the number of distance evaluations
+	};
+
+	// How much of the query ball was covered
+	struct query_stats {
+		int64_t partitions = 0; // partitions covered by the query ball
+		int64_t partitions_scanned = 0; // partitions scanned, the last may be partial
+		int64_t points_scanned = 0; // distance evaluations
+		int64_t results = 0; // points found
+		bool complete = true; // false if the budget ran out before all of the partitions were scanned
+	};
+
+	// How mvp_points is stored, chosen when the table is created
+	// An existing table keeps the layout it was created with
+	struct layout_options {
+		// The distances from each point to the vantage points are packed into one blob of uint16, rather than
+		//   a "d{id}" column and index each, so inserting a point writes the same number of B-trees however
+		//   many vantage points there are
+		// The min and max distances of the points in each partition are kept in mvp_partitions, and tighten
+		//   the lower bounds of the partitions a query covers (and rule out empty ones)
+		bool packed;
+		// The points are indexed by partition with their values (a covering index), so each partition a query
+		//   scans is read in order from contiguous pages, and balance() moves the index entries of the points
+		//   whose partition changes. Costs a second copy of the values
+		// Unlike packed, this may be added to an existing table
+		bool clustered;
+	};
 
 	MVPTable();
 
 	// Init with an open database
+	// batch_dist_fn is optional, query_batch falls back to dist_fn without it
+	// key_dist_fn is optional, queries of 8 byte values fall back to dist_fn without it
+	// With read_only, the tables must already exist: nothing is written, so only queries may be used
 	// No transaction
-	explicit MVPTable(std::shared_ptr<SQLite::Database> db, std::function<distance_fn> dist_fn);
+	explicit MVPTable(std::shared_ptr<SQLite::Database> db, std::function<distance_fn> dist_fn,
+		std::function<batch_distance_fn> batch_dist_fn = nullptr, std::function<key_distance_fn> key_dist_fn = nullptr,
+		bool read_only = false, const layout_options& layout = {});
+
+	~MVPTable();
+
+	// Open n read-only connections to the database at path, each used by a thread of its own, so that
+	// later queries scan the partitions they cover n at a time, in parallel
+	// The readers only see committed points, so the database should be in WAL mode, where readers
+	// and a writer don't block each other
+	void open_readers(const std::string& path, size_t n);
 
 	// Insert a point into mvp_points if it doesn't already exist
 	//  Each point is stored with the distances of the point to each vantage point
@@ -75,23 +145,59 @@ public:
 	// Returns the id of the point
 	int64_t insert_point(const blob_type& p_value);
 
+	// Find the point equal to p_value, through the unique index on the points' keys (or values, if
+	//   they're not 8 bytes), without computing any distances
+	// Returns false if there's no such point
+	bool find_point(const blob_type& p_value, int64_t& id);
+
+	// Delete a point from mvp_points, taking it out of the shell counts of the vantage points
+	// No transaction
+	void remove_point(int64_t id);
+
 	//how many points are there (cached)?
 	int64_t count_points();
 	int64_t count_vantage_points();
 
+	// Count the points and vantage points again, rather than keeping count
+	// No transaction
+	void recount();
+
 	// Insert a point into mvp_vantage_points
 	// Throws a std::runtime_error if the point already exists
-	// Adds a new "d{id}" column to mvp_points and fills it with the distance
-	//   from each point to vp_value
+	// Adds a new "d{id}" column to mvp_points (or packed, a distance to each point's dists)
+	//   and fills it with the distance from each point to vp_value
 	// Recomputes the mvp_points partition, balancing only the new vantage point
 	// No transaction
 	// Returns the id of the vantage point
 	int64_t insert_vantage_point(const blob_type& vp_value);
 
-	// Get point ids within `radius` of `q_value`
-	// The results (id, dist) are stored in the temp.mvp_query table
-	// Returns the number of points found
-	int64_t query(const blob_type& q_value, uint32_t radius);
+	// Get the partitions covered by the ball of `radius` around `q_value`
+	// sorted by increasing lower bound
+	std::vector<query_partition> query_partitions(const blob_type& q_value, uint32_t radius);
+
+	// Get the points within `radius` of `q_value`, visiting the covered partitions nearest first
+	// The points found in each partition are passed to `callback`, with the bound of the next partition
+	// (or radius + 1 after the last), so any point closer than that bound is final
+	// If the budget runs out the query is approximate: the last callback gets radius + 1 and the
+	// unvisited points are never seen
+	// Returns the coverage of the query
+	query_stats query(const blob_type& q_value, uint32_t radius, const std::function<query_fn>& callback,
+		const query_budget& budget = {});
+
+	// Get the points within `radius` of each of `q_values`, which must all be the same size
+	// Each partition covered by any of the queries is scanned once, and each point in it
+	// is compared against all of the queries covering it at once
+	// Returns the points found for each query, in no particular order
+	std::vector<std::vector<query_point>> query_batch(const std::vector<blob_type>& q_values, uint32_t radius);
+
+	// Get the points within `radius` of `q_value` by scanning all of them, without using the partitions
+	//   for when the distance to q_value isn't bounded by the vantage point shells (e.g. q_value is shorter than the points)
+	// Each point is first checked against `coarse`, which must never be farther from a point than q_value is
+	//   (e.g. a prefix of q_value, if the distance is over the shorter value) and should be cheaper to compare
+	// The scan is one partition, the whole table, so only a budget of points limits it, in the order the points are stored
+	// Returns the points found, in no particular order, and sets stats
+	std::vector<query_point> query_scan(const blob_type& q_value, const blob_type& coarse, uint32_t radius,
+		const query_budget& budget, query_stats& stats);
 
 	// Find a point that would make a good vantage point
 	blob_type find_vantage_point(size_t sample_size);
@@ -104,6 +210,19 @@ public:
 	// Balance the given vantage point
 	void balance(int64_t vp_id);
 
+	// Get the ids of all of the vantage points
+	std::vector<int64_t> vantage_point_ids();
+
+	// Whether the points actually fall into the shells of a balanced vantage point imbalanced beyond the threshold
+	//   as when many points are at the same distance from it, so that its shells collapse
+	// if there are fewer than min_count points in the database, returns false
+	bool is_degraded(int64_t vp_id, int64_t min_count = 50, float threshold = 0.5f);
+
+	// Replace a vantage point with another found by find_vantage_point, and balance it
+	// Returns false if the point found is already a vantage point, then nothing is changed
+	// No transaction
+	bool reselect_vantage_point(int64_t vp_id);
+
 	//balance(id) for each id in check_balance(threshold);
 	void auto_balance(int64_t min_count = 50, float threshold = 0.5f);
 
@@ -128,44 +247,86 @@ protected:
 
 	static void set_dist_fn(std::function<distance_fn> df);
 	static std::function<distance_fn> dist_fn;
+	static void set_key_dist_fn(std::function<key_distance_fn> df);
+	static std::function<key_distance_fn> key_dist_fn;
 	// callback for "mvp_distance" sql function
 	//   args are 2 point values, as blobs
 	//   returns dist_fn(args[0], args[1])
 	static void sql_distance(sqlite3_context* ctx, int n, sqlite3_value* args[]);
+	// callbacks for the packed distances, vp_index(id) being the index of a vantage point's distance
+	//   "mvp_unpack(dists, i)" returns the i'th distance in dists
+	//   "mvp_pack(dists, i, d)" returns dists with the i'th distance set to d, grown as needed
+	// callbacks for the keys of the points, 8 byte values stored as integers too
+	//   "mvp_key(value)" returns the key of value, or NULL if it isn't 8 bytes
+	//   "mvp_key_distance(k1, k2)" returns key_dist_fn(k1, k2), or NULL if either is NULL
+	static void sql_key(sqlite3_context* ctx, int n, sqlite3_value* args[]);
+	static void sql_key_distance(sqlite3_context* ctx, int n, sqlite3_value* args[]);
+	// the key of an 8 byte value, as a little endian integer
+	static bool point_key(const uint8_t* value, size_t size, int64_t& key);
+	static void sql_unpack(sqlite3_context* ctx, int n, sqlite3_value* args[]);
+	static void sql_pack(sqlite3_context* ctx, int n, sqlite3_value* args[]);
+
+	constexpr size_t vp_index(int64_t vp_id) { return static_cast<size_t>(vp_id - 1); }
+	static uint16_t unpack(const uint8_t* dists, size_t size, size_t i);
+	static void pack(blob_type& dists, size_t i, int32_t d);
+
+	// Fill the distances of each point to the vantage point vp_id (its "d{id}" column, or its place in dists)
+	void set_distances(int64_t vp_id, const blob_type& vp_value);
+
+	// Recompute the min and max distances of the points in each partition (packed only)
+	void update_summaries();
+	// Raise the bounds of parts by their summaries, given the distances from the query point
+	//   to each vantage point, dropping the empty partitions and those farther than radius
+	void apply_summaries(std::vector<query_partition>& parts, const std::vector<int32_t>& vp_dists, uint32_t radius);
 	
 	//blob to vector
 	static blob_type get_blob(sqlite3_value* val);
 	static blob_type get_blob(SQLite::Column& col);
 
+	// SELECT id, dist FROM mvp_points WHERE partition = $partition LIMIT $limit;
+	//   with dist from the keys of the points if the table has them
+	std::string str_sel_part() const;
+	// Bind the query point to a statement from str_sel_part
+	void bind_query(SQLite::Statement& sel_part, const blob_type& q_value);
+
+	// Scan a partition with sel_part, which has its query point bound, adding the points within radius
+	// Returns the number of points scanned, at most limit unless it's negative
+	int64_t scan_partition(SQLite::Statement& sel_part, int64_t partition, uint32_t radius, int64_t limit,
+		std::vector<query_point>& points);
+
 	// Update cached vp_ids
 	// Deletes ins_point if vp_ids has changed
 	void update_vp_ids(const std::vector<int64_t>& vp_ids);
 
-	//INSERT INTO mvp_points(part, value, d0, d1, ...) VALUES ($part, $value, $d0, $d1, ...) RETURNING id;
+	//INSERT INTO mvp_points(part, value, key, d0, d1, ...) VALUES ($part, $value, $key, $d0, $d1, ...) RETURNING id;
 	//where d0, d1, ... are "d{id}" for id in vp_ids
 	static const std::string str_ins_point(const std::vector<int64_t>& vp_ids);
 
-	//INSERT INTO temp.mvp_query(id, dist)
-	//  SELECT id, mvp_distance($q_value, value) AS dist
-	//    FROM mvp_points WHERE partition = $partition AND dist <= $radius;
-	static const std::string str_ins_query(const std::vector<int64_t>& vp_ids);
-
 	//The database connection
 	std::shared_ptr<SQLite::Database> db;
 	SQLStatementCache cache;
+
+	// distances from one point to a run of points, for scanning partitions (optional)
+	std::function<batch_distance_fn> batch_dist_fn;
 	
 	// we don't cache these statements because they aren't static
 
-	//INSERT INTO mvp_points(part, value, d0, d1, ...) VALUES ($part, $value, $d0, $d1, ...) RETURNING id;
+	//INSERT INTO mvp_points(part, value, key, d0, d1, ...) VALUES ($part, $value, $key, $d0, $d1, ...) RETURNING id;
 	//where d0, d1, ... are "d{id}" for id in vp_ids
 	std::unique_ptr<SQLite::Statement> ins_point;
-
-	//INSERT INTO temp.mvp_query(id, dist)
-	//  SELECT id, mvp_distance($q_value, value) FROM mvp_points
-	//    WHERE partition = $partition AND (d0 BETWEEN ? AND ?) AND ...;
-	//where d0, d1, ... are "d{id}" for id in vp_ids
-	std::unique_ptr<SQLite::Statement> ins_query;
 	
 	std::vector<int64_t> vp_ids_;
+
+	// mvp_points has a key column (it's only missing from tables opened read only from before there was one)
+	bool keyed;
+	bool packed;
+
+	// read-only connections for parallel partition scans, one per worker of the pool
+	struct Reader {
+		std::unique_ptr<SQLite::Database> db;
+		std::unique_ptr<SQLite::Statement> sel_part;
+	};
+	std::vector<Reader> readers;
+	std::unique_ptr<imghash::ThreadPool> pool;
 	
 };
\ No newline at end of file
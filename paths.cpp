@@ -0,0 +1,170 @@
+#include "paths.h"
+#include "input.h"
+
+#include <filesystem>
+#include <algorithm>
+#include <stdexcept>
+#include <cctype>
+#include <cstdio>
+
+namespace fs = std::filesystem;
+
+namespace imghash {
+
+	namespace {
+		std::string lowercase(std::string s)
+		{
+			std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+			return s;
+		}
+	}
+
+	std::vector<std::string> default_extensions()
+	{
+		std::vector<std::string> extensions{ "ppm", "pgm", "pnm" };
+#ifdef USE_JPEG
+		extensions.insert(extensions.end(), { "jpg", "jpeg" });
+#endif
+#ifdef USE_PNG
+		extensions.push_back("png");
+#endif
+		return extensions;
+	}
+
+	PathSource::PathSource(std::vector<std::string> paths, std::string files_from, bool recursive,
+		const std::vector<std::string>& extensions, size_t threads)
+		: paths(std::move(paths)), files_from(std::move(files_from)), recursive(recursive),
+		queue(4096), pool(threads), stopped(false), ended(false)
+	{
+		for (auto ext : extensions) {
+			if (!ext.empty() && ext[0] == '.') ext.erase(0, 1);
+			this->extensions.push_back(lowercase(ext));
+		}
+		thread = std::thread(&PathSource::run, this);
+	}
+
+	PathSource::~PathSource()
+	{
+		cancel();
+		thread.join();
+	}
+
+	bool PathSource::next(std::string& path)
+	{
+		if (ended || !queue.pop(path)) return false;
+		if (!path.empty()) return true;
+
+		ended = true;
+		std::lock_guard<std::mutex> lock(mutex);
+		if (error) std::rethrow_exception(error);
+		return false;
+	}
+
+	void PathSource::cancel()
+	{
+		stopped = true;
+		queue.close();
+	}
+
+	void PathSource::fail(std::exception_ptr e)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!error) error = e;
+		}
+		stopped = true;
+	}
+
+	void PathSource::run()
+	{
+		try {
+			bool more = true;
+			for (size_t i = 0; more && i < paths.size(); ++i) more = emit(paths[i]);
+
+			if (more && !files_from.empty()) {
+				FILE* file = (files_from == "-") ? stdin : fopen(files_from.c_str(), "rb");
+				if (file == nullptr) {
+					throw std::runtime_error("Failed to open list file: " + files_from);
+				}
+				try {
+					Input input(file);
+					std::string path;
+					int c;
+					while (more && (c = input.get()) != EOF) {
+						if (c != '\0') {
+							path += static_cast<char>(c);
+						}
+						else if (!path.empty()) {
+							more = emit(path);
+							path.clear();
+						}
+					}
+					//the last path needn't be terminated
+					if (more && !path.empty()) emit(path);
+				}
+				catch (...) {
+					if (file != stdin) fclose(file);
+					throw;
+				}
+				if (file != stdin) fclose(file);
+			}
+		}
+		catch (...) {
+			fail(std::current_exception());
+		}
+		queue.push(std::string());
+	}
+
+	bool PathSource::emit(const std::string& path)
+	{
+		std::error_code ec;
+		if (recursive && fs::is_directory(path, ec)) {
+			walk(path);
+			pool.wait();
+			return !stopped;
+		}
+		return queue.push(path);
+	}
+
+	void PathSource::walk(const std::string& dir)
+	{
+		//each directory is a task, so that subdirectories are listed in parallel
+		pool.submit([this, dir]() {
+			if (stopped) return;
+			try {
+				std::error_code ec;
+				fs::directory_iterator it(dir, ec), end;
+				while (!ec && it != end) {
+					if (stopped) return;
+					//links to directories aren't followed, so a walk can't loop
+					std::error_code type_ec;
+					auto type = it->symlink_status(type_ec).type();
+					std::string path = it->path().string();
+					if (type == fs::file_type::directory) {
+						walk(path);
+					}
+					else if (matches(path) && !queue.push(std::move(path))) {
+						return;
+					}
+					it.increment(ec);
+				}
+				if (ec) {
+					throw std::runtime_error("Failed to read directory: " + dir);
+				}
+			}
+			catch (...) {
+				fail(std::current_exception());
+			}
+		});
+	}
+
+	bool PathSource::matches(const std::string& path) const
+	{
+		if (extensions.empty()) return true;
+		auto dot = path.find_last_of("./\\");
+		if (dot == std::string::npos || path[dot] != '.') return false;
+		auto ext = lowercase(path.substr(dot + 1));
+		return std::find(extensions.begin(), extensions.end(), ext) != extensions.end();
+	}
+
+}
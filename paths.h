@@ -0,0 +1,62 @@
+#pragma once
+
+#include "threadpool.h"
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <exception>
+
+namespace imghash {
+
+	//! A stream of the paths of files to hash, found while they are being hashed
+	/*!
+	Paths come from the command line, then from a list file (NUL separated, "-" for stdin). With recursive
+	set, directories are walked, keeping only the files with one of the given extensions (case insensitive).
+	The subdirectories of a directory are walked in parallel, so the order of the files found in a directory
+	is not fixed, but each path given is finished before the next is started.
+
+	Paths are found on threads of their own, and handed out through a bounded queue, so a huge corpus can
+	be hashed by one process without ever holding all of its paths.
+	*/
+	class PathSource
+	{
+		std::vector<std::string> paths;
+		std::string files_from;
+		bool recursive;
+		std::vector<std::string> extensions; // lowercase, without the dot
+
+		BoundedQueue<std::string> queue; // an empty path marks the end
+		ThreadPool pool; // walks directories
+		std::mutex mutex;
+		std::exception_ptr error; // the first error, thrown once the paths before it are taken
+		std::atomic<bool> stopped;
+		bool ended; // the end marker has been taken
+		std::thread thread; // finds the paths, started once everything else is constructed
+
+		void run();
+		bool emit(const std::string& path);
+		void walk(const std::string& dir);
+		bool matches(const std::string& path) const;
+		void fail(std::exception_ptr e);
+	public:
+		PathSource(std::vector<std::string> paths, std::string files_from, bool recursive,
+			const std::vector<std::string>& extensions, size_t threads);
+		~PathSource();
+
+		PathSource(const PathSource&) = delete;
+		PathSource& operator=(const PathSource&) = delete;
+
+		//! The next path. Returns false at the end. Throws if a list file or directory can't be read
+		bool next(std::string& path);
+
+		//! Stop finding paths, e.g. when hashing has failed
+		void cancel();
+	};
+
+	//! The extensions of the file formats that were compiled in, for filtering directory walks
+	std::vector<std::string> default_extensions();
+
+}
@@ -4,12 +4,10 @@
 
 namespace imghash {
 
-	bool test_png(FILE* file)
+	bool test_png(Input& input)
 	{
-		png_byte header[8] = { 0 };
-		auto off = ftell(file);
-		size_t n = fread(header, sizeof(png_byte), 8, file);
-		fseek(file, off, SEEK_SET);
+		const uint8_t* header;
+		size_t n = input.peek(header, 8);
 		return (n == 8) && (png_sig_cmp(header, 0, 8) == 0);
 	}
 
@@ -24,9 +22,16 @@ namespace imghash {
 		{
 			return; //ignore warnings
 		}
+		void my_read_fn(png_structp png_ptr, png_bytep data, png_size_t length)
+		{
+			Input* input = (Input*)png_get_io_ptr(png_ptr);
+			if (input->read(data, length) < length) {
+				png_error(png_ptr, "Unexpected EOF");
+			}
+		}
 	}
 
-	Image<float> load_png(FILE* file, Preprocess& prep)
+	Image<float> load_png(Input& input, Preprocess& prep)
 	{
 		std::string error_message;
 		png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING,
@@ -52,7 +57,7 @@ namespace imghash {
 			throw std::runtime_error("PNG: Error");
 		}
 
-		png_init_io(png_ptr, file);
+		png_set_read_fn(png_ptr, &input, my_read_fn);
 		//ignore all unkown chunks
 		png_set_keep_unknown_chunks(png_ptr, PNG_HANDLE_CHUNK_NEVER, nullptr, 0);
 		
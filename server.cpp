@@ -0,0 +1,351 @@
+#include "server.h"
+#include "input.h"
+#ifdef USE_SQLITE
+#include "db.h"
+#endif
+
+#include <stdexcept>
+#include <future>
+#include <thread>
+#include <cstring>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <csignal>
+#include <cerrno>
+#endif
+
+namespace imghash {
+
+	namespace {
+		//a bigger request is refused, and its connection closed
+		const size_t max_request_size = 256 << 20;
+
+		void put(std::vector<uint8_t>& out, uint64_t v, size_t n)
+		{
+			for (size_t i = 0; i < n; ++i) out.push_back(static_cast<uint8_t>(v >> (8 * i)));
+		}
+
+#ifdef USE_SQLITE
+		void put(std::vector<uint8_t>& out, const std::string& s, size_t n)
+		{
+			put(out, s.size(), n);
+			out.insert(out.end(), s.begin(), s.end());
+		}
+#endif
+
+		//reads the fields of a request, throwing if it's cut short
+		class RequestReader
+		{
+			const uint8_t* pos;
+			const uint8_t* end;
+		public:
+			RequestReader(const std::vector<uint8_t>& request) : pos(request.data()), end(request.data() + request.size()) {}
+
+			uint64_t get(size_t n)
+			{
+				if (static_cast<size_t>(end - pos) < n) throw std::runtime_error("Request too short");
+				uint64_t v = 0;
+				for (size_t i = n; i > 0; --i) v = (v << 8) | pos[i - 1];
+				pos += n;
+				return v;
+			}
+
+			std::string get_string(size_t n)
+			{
+				size_t size = static_cast<size_t>(get(n));
+				if (static_cast<size_t>(end - pos) < size) throw std::runtime_error("Request too short");
+				std::string s(reinterpret_cast<const char*>(pos), size);
+				pos += size;
+				return s;
+			}
+
+			//the rest of the request
+			const uint8_t* rest() const { return pos; }
+			size_t rest_size() const { return static_cast<size_t>(end - pos); }
+		};
+
+#ifndef _WIN32
+		//written to by the signal handler, to wake the accept loop
+		int signal_pipe[2] = { -1, -1 };
+
+		void on_signal(int)
+		{
+			int saved = errno;
+			char c = 0;
+			if (write(signal_pipe[1], &c, 1) < 0) {
+				//the loop is already woken
+			}
+			errno = saved;
+		}
+
+		bool read_all(int fd, uint8_t* data, size_t size)
+		{
+			while (size > 0) {
+				ssize_t n = read(fd, data, size);
+				if (n < 0 && errno == EINTR) continue;
+				if (n <= 0) return false;
+				data += n;
+				size -= static_cast<size_t>(n);
+			}
+			return true;
+		}
+
+		bool write_all(int fd, const uint8_t* data, size_t size)
+		{
+			while (size > 0) {
+				ssize_t n = write(fd, data, size);
+				if (n < 0 && errno == EINTR) continue;
+				if (n <= 0) return false;
+				data += n;
+				size -= static_cast<size_t>(n);
+			}
+			return true;
+		}
+
+		bool write_frame(int fd, const std::vector<uint8_t>& frame)
+		{
+			std::vector<uint8_t> size;
+			put(size, frame.size(), 4);
+			return write_all(fd, size.data(), size.size()) && write_all(fd, frame.data(), frame.size());
+		}
+#endif
+	}
+
+	Server::Server(const std::string& path, const hasher_factory& make_hasher, size_t jobs, Database* db)
+		: path(path), listen_fd(-1), db(db), pool(jobs)
+	{
+		for (size_t i = 0; i < pool.size(); ++i) {
+			preps.emplace_back(128, 128);
+			hashers.push_back(make_hasher());
+		}
+#ifdef USE_SQLITE
+		if (db) {
+			for (const auto& d : db->digests()) digests.insert(d.first, d.second);
+		}
+#endif
+
+#ifdef _WIN32
+		throw std::runtime_error("--serve is only supported on POSIX systems");
+#else
+		sockaddr_un addr;
+		std::memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (path.size() >= sizeof(addr.sun_path)) {
+			throw std::runtime_error("Socket path too long");
+		}
+		std::memcpy(addr.sun_path, path.c_str(), path.size());
+
+		listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (listen_fd < 0) {
+			throw std::runtime_error("Failed to create socket");
+		}
+
+		//a socket left behind by a server that's gone is replaced, but not one that's still serving
+		struct stat st;
+		if (stat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+			int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+			bool live = probe >= 0 && connect(probe, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0;
+			if (probe >= 0) close(probe);
+			if (live) {
+				close(listen_fd);
+				throw std::runtime_error("Socket is in use by another server: " + path);
+			}
+			unlink(path.c_str());
+		}
+
+		if (bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(listen_fd, SOMAXCONN) != 0) {
+			close(listen_fd);
+			throw std::runtime_error("Failed to listen on socket: " + path);
+		}
+#endif
+	}
+
+	Server::~Server()
+	{
+#ifndef _WIN32
+		close(listen_fd);
+		unlink(path.c_str());
+#endif
+	}
+
+	void Server::run()
+	{
+#ifndef _WIN32
+		if (pipe(signal_pipe) != 0) {
+			throw std::runtime_error("Failed to create pipe");
+		}
+		struct sigaction sa, old_int, old_term, old_pipe;
+		std::memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = on_signal;
+		sigaction(SIGINT, &sa, &old_int);
+		sigaction(SIGTERM, &sa, &old_term);
+		//a client that goes away mid-response only loses its connection
+		sa.sa_handler = SIG_IGN;
+		sigaction(SIGPIPE, &sa, &old_pipe);
+
+		pollfd fds[2];
+		fds[0].fd = listen_fd;
+		fds[0].events = POLLIN;
+		fds[1].fd = signal_pipe[0];
+		fds[1].events = POLLIN;
+		while (true) {
+			if (poll(fds, 2, -1) < 0) {
+				if (errno == EINTR) continue;
+				break;
+			}
+			if (fds[1].revents) break;
+			if (!(fds[0].revents & POLLIN)) continue;
+
+			int fd = accept(listen_fd, nullptr, nullptr);
+			if (fd < 0) continue;
+			fcntl(fd, F_SETFD, FD_CLOEXEC);
+			{
+				std::lock_guard<std::mutex> lock(clients_mutex);
+				clients.insert(fd);
+			}
+			std::thread(&Server::serve, this, fd).detach();
+		}
+
+		//stop reading requests, but finish the ones being served
+		{
+			std::unique_lock<std::mutex> lock(clients_mutex);
+			for (int fd : clients) shutdown(fd, SHUT_RD);
+			cv_clients.wait(lock, [&] { return clients.empty(); });
+		}
+
+		sigaction(SIGINT, &old_int, nullptr);
+		sigaction(SIGTERM, &old_term, nullptr);
+		sigaction(SIGPIPE, &old_pipe, nullptr);
+		close(signal_pipe[0]);
+		close(signal_pipe[1]);
+		signal_pipe[0] = signal_pipe[1] = -1;
+#endif
+	}
+
+	void Server::serve(int fd)
+	{
+#ifndef _WIN32
+		std::vector<uint8_t> request;
+		while (true) {
+			uint8_t size_bytes[4];
+			if (!read_all(fd, size_bytes, 4)) break;
+			size_t size = 0;
+			for (size_t i = 4; i > 0; --i) size = (size << 8) | size_bytes[i - 1];
+			if (size > max_request_size) {
+				std::vector<uint8_t> response{ 1 };
+				std::string message = "Request too large";
+				response.insert(response.end(), message.begin(), message.end());
+				write_frame(fd, response);
+				break;
+			}
+			request.resize(size);
+			if (!read_all(fd, request.data(), size)) break;
+			if (!write_frame(fd, handle(request))) break;
+		}
+		//nothing of the server is touched after this, as it may be gone once the lock is released
+		// the fd is closed under the lock, once it's out of clients, so accept() can't reuse its number for
+		// a new client before then
+		std::lock_guard<std::mutex> lock(clients_mutex);
+		clients.erase(fd);
+		close(fd);
+		cv_clients.notify_all();
+#endif
+	}
+
+	Hasher::hash_type Server::hash(const uint8_t* data, size_t size, Digest& d)
+	{
+		d = digest(data, size);
+		Hasher::hash_type h;
+		if (digests.find(d, h)) return h;
+
+		//decoded on the pool, so that however many clients there are, only `jobs` images are decoded at once
+		std::promise<Hasher::hash_type> result;
+		pool.submit([&]() {
+			try {
+				auto w = pool.worker_index();
+				Input input(data, size);
+				result.set_value(hashers[w]->apply(load(input, preps[w])));
+			}
+			catch (...) {
+				result.set_exception(std::current_exception());
+			}
+		});
+		h = result.get_future().get();
+		digests.insert(d, h);
+		return h;
+	}
+
+	std::vector<uint8_t> Server::handle(const std::vector<uint8_t>& request)
+	{
+		std::vector<uint8_t> response{ 0 };
+		try {
+			RequestReader in(request);
+			char op = static_cast<char>(in.get(1));
+			if (op != 'H' && !db) {
+				throw std::runtime_error("No database");
+			}
+			Digest d;
+			switch (op) {
+			case 'H': {
+				auto h = hash(in.rest(), in.rest_size(), d);
+				response.insert(response.end(), h.begin(), h.end());
+				break;
+			}
+#ifdef USE_SQLITE
+			case 'A': {
+				Database::entry e;
+				e.item = in.get_string(2);
+				e.point = hash(in.rest(), in.rest_size(), d);
+				e.digest = d;
+				{
+					std::lock_guard<std::mutex> lock(db_mutex);
+					db->insert(e);
+				}
+				response.insert(response.end(), e.point.begin(), e.point.end());
+				break;
+			}
+			case 'Q': {
+				unsigned int dist = static_cast<unsigned int>(in.get(4));
+				size_t limit = static_cast<size_t>(in.get(4));
+				auto h = hash(in.rest(), in.rest_size(), d);
+				std::vector<Database::query_result> matches;
+				{
+					std::lock_guard<std::mutex> lock(db_mutex);
+					matches = db->query(h, dist, limit);
+				}
+				put(response, h.size(), 1);
+				response.insert(response.end(), h.begin(), h.end());
+				put(response, matches.size(), 4);
+				for (const auto& m : matches) {
+					put(response, static_cast<uint32_t>(std::get<0>(m)), 4);
+					put(response, static_cast<uint32_t>(std::get<2>(m)), 4);
+					put(response, std::get<1>(m), 2);
+				}
+				break;
+			}
+			case 'R': {
+				std::string name(reinterpret_cast<const char*>(in.rest()), in.rest_size());
+				std::lock_guard<std::mutex> lock(db_mutex);
+				db->remove(name);
+				break;
+			}
+#endif
+			default:
+				throw std::runtime_error("Unknown request");
+			}
+		}
+		catch (std::exception& e) {
+			response.assign(1, 1);
+			std::string message = e.what();
+			response.insert(response.end(), message.begin(), message.end());
+		}
+		return response;
+	}
+
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "imghash.h"
+#include "threadpool.h"
+#include "digest.h"
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_set>
+
+namespace imghash {
+
+	class Database;
+
+	//! Serves hash, add, query and remove requests on a Unix domain socket, keeping the database and hashers warm
+	/*!
+	Each request and response is a frame: its size in bytes, as a 32-bit little endian number, then that
+	many bytes. A request starts with an op byte, and a response with a status byte: 0 for success, or 1
+	followed by an error message. All numbers are little endian.
+
+	  'H' image                         -> hash
+	  'A' u16 name size, name, image    -> hash, once the image is added to the database
+	  'Q' u32 dist, u32 limit, image    -> u8 hash size, hash, u32 count, then for each match, nearest first:
+	                                       u32 dist, u32 n, u16 name size, name (n is which of the
+	                                       name's images matched, e.g. a frame of a stream)
+	  'R' name                          -> nothing, once the name is removed from the database
+
+	An image is a whole file in any supported format. Clients are served concurrently, each on a thread
+	of its own, and a client may send several requests on one connection, which are answered in order.
+	Images are decoded on a shared pool, with a Preprocess and Hasher per worker, and requests that touch
+	the database take turns on it. Byte-identical images get the hash of the first one without being
+	decoded again. POSIX only.
+	*/
+	class Server
+	{
+	public:
+		using hasher_factory = std::function<std::unique_ptr<Hasher>()>;
+
+		//! Listen on the socket at path, replacing a stale one. db may be null, then only hash requests are served
+		Server(const std::string& path, const hasher_factory& make_hasher, size_t jobs, Database* db);
+
+		//! Stop serving, and remove the socket
+		~Server();
+
+		Server(const Server&) = delete;
+		Server& operator=(const Server&) = delete;
+
+		//! Accept clients until SIGINT or SIGTERM, then wait for the requests being served
+		void run();
+
+	private:
+		std::vector<uint8_t> handle(const std::vector<uint8_t>& request);
+		Hasher::hash_type hash(const uint8_t* data, size_t size, Digest& d);
+		void serve(int fd);
+
+		std::string path;
+		int listen_fd;
+		Database* db;
+		std::mutex db_mutex;
+
+		//each worker of the pool gets its own Preprocess and Hasher
+		std::vector<Preprocess> preps;
+		std::vector<std::unique_ptr<Hasher>> hashers;
+		DigestTable digests;
+		ThreadPool pool;
+
+		//the connections being served, each on a detached thread
+		std::mutex clients_mutex;
+		std::condition_variable cv_clients;
+		std::unordered_set<int> clients;
+	};
+
+}
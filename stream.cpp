@@ -0,0 +1,400 @@
+#include "stream.h"
+
+#include <stdexcept>
+#include <string>
+#include <sstream>
+#include <algorithm>
+#include <cctype>
+
+namespace imghash {
+
+	std::unique_ptr<StreamReader> open_stream(Input& input, bool luma)
+	{
+		const uint8_t* magic;
+		size_t n = input.peek(magic, 9);
+		if (n == 9 && std::equal(magic, magic + n, "YUV4MPEG2")) {
+			return std::make_unique<Y4MStreamReader>(input, luma);
+		}
+	#ifdef USE_JPEG
+		if (test_jpeg(input)) {
+			return std::make_unique<MJPEGStreamReader>(input);
+		}
+	#endif
+	#ifdef USE_PNG
+		if (test_png(input)) {
+			return std::make_unique<PNGStreamReader>(input);
+		}
+	#endif
+		if (n == 0 || test_ppm(input)) {
+			//an empty stream is reported by the reader
+			return std::make_unique<PPMStreamReader>(input);
+		}
+		throw std::runtime_error("Unsupported stream format");
+	}
+
+	PPMStreamReader::PPMStreamReader(Input& input) : input(input), first(true) {}
+
+	bool PPMStreamReader::read(Frame& frame)
+	{
+		//it's OK to get an empty file after the first frame
+		PPMHeader header;
+		bool found = read_ppm_header(input, header, first);
+		first = false;
+		if (!found) return false;
+
+		frame.width = header.width;
+		frame.height = header.height;
+		frame.maxval = header.maxval;
+		frame.channels = header.channels;
+		frame.data.resize(header.raster_size());
+		if (input.read(frame.data.data(), frame.data.size()) < frame.data.size()) {
+			throw std::runtime_error("PPM: Not enough data");
+		}
+		return true;
+	}
+
+	Image<float> PPMStreamReader::decode(const Frame& frame, Preprocess& prep) const
+	{
+		return load_ppm_raster(PPMHeader{ frame.width, frame.height, frame.maxval, frame.channels }, frame.data.data(), prep);
+	}
+
+	Y4MStreamReader::Y4MStreamReader(Input& input, bool luma)
+		: input(input), luma(luma), width(0), height(0), sub_x(2), sub_y(2), depth(8), alpha(0)
+	{
+		//YUV4MPEG2 W<width> H<height> [<tag><value> ...]\n
+		std::string header;
+		for (int c = input.get(); c != '\n'; c = input.get()) {
+			if (c == EOF) throw std::runtime_error("Y4M: Unexpected EOF");
+			if (header.size() >= 1024) throw std::runtime_error("Y4M: Header too long");
+			header.push_back(static_cast<char>(c));
+		}
+
+		std::istringstream tags(header);
+		std::string tag;
+		tags >> tag;
+		if (tag != "YUV4MPEG2") {
+			throw std::runtime_error("Y4M: Invalid stream (" + tag + ")");
+		}
+		while (tags >> tag) {
+			std::string value = tag.substr(1);
+			switch (tag[0]) {
+			case 'W':
+				width = static_cast<size_t>(std::stoul(value));
+				break;
+			case 'H':
+				height = static_cast<size_t>(std::stoul(value));
+				break;
+			case 'C': {
+				//colorspace: 420jpeg, 420paldv, 420mpeg2, 420p10, 422, 444p16, 444alpha, mono, mono12 ...
+				if (value.compare(0, 4, "mono") == 0) {
+					sub_x = sub_y = 0;
+					if (value.size() > 4) depth = static_cast<size_t>(std::stoul(value.substr(4)));
+				}
+				else {
+					auto sub = value.substr(0, 3);
+					if (sub == "420") { sub_x = 2; sub_y = 2; }
+					else if (sub == "422") { sub_x = 2; sub_y = 1; }
+					else if (sub == "411") { sub_x = 4; sub_y = 1; }
+					else if (sub == "444") { sub_x = 1; sub_y = 1; }
+					else throw std::runtime_error("Y4M: Unsupported colorspace (" + value + ")");
+					if (value.compare(3, std::string::npos, "alpha") == 0) alpha = 1;
+					else if (value.size() > 4 && value[3] == 'p' && isdigit(value[4])) depth = static_cast<size_t>(std::stoul(value.substr(4)));
+				}
+				break;
+			}
+			default:
+				//frame rate, interlacing, aspect ratio, comments: nothing that matters for hashing
+				break;
+			}
+		}
+
+		if (width == 0 || height == 0) {
+			throw std::runtime_error("Y4M: Missing frame size");
+		}
+		if (depth < 8 || depth > 16) {
+			throw std::runtime_error("Y4M: Unsupported bit depth");
+		}
+		const size_t maxsize = 0x40000000; // 1 GB, as for PPM
+		if (luma_size() * (1 + alpha) + 2 * chroma_size() > maxsize) {
+			throw std::runtime_error("Y4M: Size overflow");
+		}
+	}
+
+	bool Y4MStreamReader::read(Frame& frame)
+	{
+		//FRAME [<tag><value> ...]\n
+		const char magic[] = "FRAME";
+		int c = input.get();
+		if (c == EOF) return false;
+		for (size_t i = 0; magic[i] != 0; ++i, c = input.get()) {
+			if (c != magic[i]) throw std::runtime_error("Y4M: Invalid frame header");
+		}
+		for (; c != '\n'; c = input.get()) {
+			if (c == EOF) throw std::runtime_error("Y4M: Unexpected EOF");
+		}
+
+		frame.width = width;
+		frame.height = height;
+		frame.maxval = (size_t(1) << depth) - 1;
+		frame.channels = (luma || sub_x == 0) ? 1 : 3;
+
+		//the luma plane comes first, then the chroma planes (and alpha)
+		size_t keep = luma ? luma_size() : luma_size() + 2 * chroma_size();
+		size_t rest = luma_size() + 2 * chroma_size() + alpha * luma_size() - keep;
+		frame.data.resize(keep);
+		if (input.read(frame.data.data(), keep) < keep) {
+			throw std::runtime_error("Y4M: Not enough data");
+		}
+		while (rest > 0) {
+			//skipped in the input's buffer, without a copy
+			const uint8_t* data;
+			size_t n = input.peek(data, std::min(rest, size_t(0x10000)));
+			if (n == 0) {
+				throw std::runtime_error("Y4M: Not enough data");
+			}
+			input.skip(n);
+			rest -= n;
+		}
+		return true;
+	}
+
+	Image<float> Y4MStreamReader::decode(const Frame& frame, Preprocess& prep) const
+	{
+		const uint8_t* y_plane = frame.data.data();
+		//samples over 8 bits are 16 bit little-endian
+		auto sample = [&](const uint8_t* plane, size_t i) -> uint32_t {
+			if (depth > 8) return plane[2 * i] | (plane[2 * i + 1] << 8);
+			else return plane[i];
+		};
+
+		if (luma || sub_x == 0) {
+			if (depth == 8) {
+				//the rows can be used in place
+				prep.start(height, width, 1);
+				for (const uint8_t* row = y_plane; prep.add_row(row); row += width);
+			}
+			else {
+				std::vector<uint16_t> row(width);
+				prep.start(height, width, 1);
+				size_t i = 0;
+				do {
+					for (size_t x = 0; x < width; ++x, ++i) {
+						row[x] = static_cast<uint16_t>(sample(y_plane, i) << (16 - depth));
+					}
+				} while (prep.add_row(row.data()));
+			}
+			return prep.stop();
+		}
+
+		//convert to RGB at the chroma resolution, averaging the luma over each chroma sample
+		const uint8_t* u_plane = y_plane + luma_size();
+		const uint8_t* v_plane = u_plane + chroma_size();
+		size_t cw = chroma_width(), ch = chroma_height();
+		float scale = 255.0f / frame.maxval; //to 8 bit levels
+		std::vector<float> row(cw * 3);
+		prep.start(ch, cw, 3);
+		size_t cy = 0;
+		do {
+			size_t y0 = cy * sub_y, y1 = std::min(y0 + sub_y, height);
+			for (size_t cx = 0; cx < cw; ++cx) {
+				size_t x0 = cx * sub_x, x1 = std::min(x0 + sub_x, width);
+				uint32_t sum = 0;
+				for (size_t y = y0; y < y1; ++y) {
+					for (size_t x = x0; x < x1; ++x) {
+						sum += sample(y_plane, y * width + x);
+					}
+				}
+				//BT.601, limited range
+				float l = 1.164f * (scale * sum / ((y1 - y0) * (x1 - x0)) - 16.0f);
+				float u = scale * sample(u_plane, cy * cw + cx) - 128.0f;
+				float v = scale * sample(v_plane, cy * cw + cx) - 128.0f;
+				float rgb[3] = {
+					l + 1.596f * v,
+					l - 0.392f * u - 0.813f * v,
+					l + 2.017f * u
+				};
+				for (size_t c = 0; c < 3; ++c) {
+					row[cx * 3 + c] = std::min(std::max(rgb[c] / 255.0f, 0.0f), 1.0f);
+				}
+			}
+			++cy;
+		} while (prep.add_row(row.data()));
+		return prep.stop();
+	}
+
+#ifdef USE_JPEG
+	MJPEGStreamReader::MJPEGStreamReader(Input& input) : input(input) {}
+
+	bool MJPEGStreamReader::read(Frame& frame)
+	{
+		frame.data.clear();
+		auto get = [&]() {
+			int c = input.get();
+			if (c == EOF) throw std::runtime_error("MJPEG: Unexpected EOF");
+			frame.data.push_back(static_cast<uint8_t>(c));
+			return c;
+		};
+
+		//SOI
+		int c = input.get();
+		if (c == EOF) return false;
+		frame.data.push_back(static_cast<uint8_t>(c));
+		if (c != 0xFF || get() != 0xD8) {
+			throw std::runtime_error("MJPEG: Invalid frame");
+		}
+
+		//segments, up to EOI
+		int marker = -1; // a marker already read at the end of entropy-coded data
+		while (true) {
+			if (marker < 0) {
+				if (get() != 0xFF) throw std::runtime_error("MJPEG: Invalid marker");
+				do marker = get(); while (marker == 0xFF); //fill bytes
+			}
+			int m = marker;
+			marker = -1;
+			if (m == 0xD9) break; //EOI
+			if (m == 0x01 || (m >= 0xD0 && m <= 0xD7)) continue; //no length or payload
+
+			//the length includes its own 2 bytes
+			size_t length = static_cast<size_t>(get()) << 8;
+			length |= static_cast<size_t>(get());
+			if (length < 2) throw std::runtime_error("MJPEG: Invalid segment length");
+			size_t off = frame.data.size();
+			frame.data.resize(off + length - 2);
+			if (input.read(frame.data.data() + off, length - 2) < length - 2) {
+				throw std::runtime_error("MJPEG: Unexpected EOF");
+			}
+
+			if (m == 0xDA) {
+				//SOS: entropy-coded data runs to the next marker that isn't a stuffed 0 or a restart
+				while (marker < 0) {
+					if (get() != 0xFF) continue;
+					do c = get(); while (c == 0xFF);
+					if (c != 0x00 && (c < 0xD0 || c > 0xD7)) marker = c;
+				}
+			}
+		}
+		return true;
+	}
+
+	Image<float> MJPEGStreamReader::decode(const Frame& frame, Preprocess& prep) const
+	{
+		Input in(frame.data.data(), frame.data.size());
+		return load_jpeg(in, prep, true);
+	}
+#endif
+
+#ifdef USE_PNG
+	PNGStreamReader::PNGStreamReader(Input& input) : input(input) {}
+
+	bool PNGStreamReader::read(Frame& frame)
+	{
+		if (input.at_end()) return false;
+
+		//signature
+		if (!test_png(input)) {
+			throw std::runtime_error("PNG: Invalid frame");
+		}
+		frame.data.resize(8);
+		input.read(frame.data.data(), 8);
+
+		//chunks: length (4 bytes, MSB first), type (4), data (length), CRC (4), up to IEND
+		while (true) {
+			size_t off = frame.data.size();
+			frame.data.resize(off + 8);
+			if (input.read(frame.data.data() + off, 8) < 8) {
+				throw std::runtime_error("PNG: Unexpected EOF");
+			}
+			const uint8_t* chunk = frame.data.data() + off;
+			size_t length = (size_t(chunk[0]) << 24) | (size_t(chunk[1]) << 16) | (size_t(chunk[2]) << 8) | size_t(chunk[3]);
+			bool end = std::equal(chunk + 4, chunk + 8, "IEND");
+			if (length > 0x7FFFFFFF) {
+				throw std::runtime_error("PNG: Invalid chunk length");
+			}
+			off = frame.data.size();
+			frame.data.resize(off + length + 4);
+			if (input.read(frame.data.data() + off, length + 4) < length + 4) {
+				throw std::runtime_error("PNG: Unexpected EOF");
+			}
+			if (end) return true;
+		}
+	}
+
+	Image<float> PNGStreamReader::decode(const Frame& frame, Preprocess& prep) const
+	{
+		Input in(frame.data.data(), frame.data.size());
+		return load_png(in, prep);
+	}
+#endif
+
+	HashPipeline::HashPipeline(StreamReader& reader, size_t width, size_t height, const hasher_factory& make_hasher, size_t jobs)
+		: reader(reader), frames(jobs + 2), free_frames(jobs + 2), results(4 * jobs + 4), done(false), pool(jobs)
+	{
+		//one frame per worker, plus one being read and one waiting
+		for (auto& f : frames) free_frames.push(&f);
+		for (size_t i = 0; i < pool.size(); ++i) {
+			preps.emplace_back(width, height);
+			hashers.push_back(make_hasher());
+		}
+		reader_thread = std::thread(&HashPipeline::read_frames, this);
+	}
+
+	HashPipeline::~HashPipeline()
+	{
+		//release the reader, if it's waiting on the consumer
+		results.cancel();
+		free_frames.close();
+		if (reader_thread.joinable()) reader_thread.join();
+	}
+
+	bool HashPipeline::next(Hasher::hash_type& hash)
+	{
+		if (done) return false;
+		result res = results.take();
+		if (res.error) {
+			done = true;
+			std::rethrow_exception(res.error);
+		}
+		if (res.end) {
+			done = true;
+			return false;
+		}
+		hash = std::move(res.hash);
+		return true;
+	}
+
+	void HashPipeline::read_frames()
+	{
+		for (size_t i = 0; ; ++i) {
+			Frame* frame = nullptr;
+			if (!results.reserve(i) || !free_frames.pop(frame)) return;
+
+			//the end of the stream (or a read error) takes the next index, so it comes out after the last frame
+			result res;
+			try {
+				if (!reader.read(*frame)) res.end = true;
+			}
+			catch (...) {
+				res.error = std::current_exception();
+			}
+			if (res.end || res.error) {
+				results.put(i, std::move(res));
+				return;
+			}
+
+			pool.submit([this, i, frame]() {
+				auto w = pool.worker_index();
+				result res;
+				try {
+					res.hash = hashers[w]->apply(reader.decode(*frame, preps[w]));
+				}
+				catch (...) {
+					res.error = std::current_exception();
+				}
+				free_frames.push(frame);
+				results.put(i, std::move(res));
+			});
+		}
+	}
+
+}
@@ -0,0 +1,166 @@
+#pragma once
+
+#include "imghash.h"
+#include "threadpool.h"
+
+#include <vector>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <exception>
+
+namespace imghash {
+
+	//! A frame read from a stream, not yet decoded
+	/*!
+	Frames are reused from one read to the next, so data keeps its capacity
+	*/
+	struct Frame {
+		size_t width = 0, height = 0, channels = 0, maxval = 0;
+		std::vector<uint8_t> data;
+	};
+
+	//! Reads the frames of an image stream (e.g. piped from ffmpeg)
+	/*!
+	Reading is split from decoding so that one thread can read frames while others decode them.
+	*/
+	class StreamReader
+	{
+	public:
+		virtual ~StreamReader() {}
+
+		//! Read the next frame into frame. Returns false at the end of the stream
+		virtual bool read(Frame& frame) = 0;
+
+		//! Decode a frame. May be called from any thread
+		virtual Image<float> decode(const Frame& frame, Preprocess& prep) const = 0;
+	};
+
+	//! Open a reader for the stream's format, sniffed from its first bytes
+	/*!
+	With luma, y4m frames are hashed on the Y plane only (see Y4MStreamReader)
+	*/
+	std::unique_ptr<StreamReader> open_stream(Input& input, bool luma = false);
+
+	//! Stream of concatenated binary PPM images
+	class PPMStreamReader : public StreamReader
+	{
+		Input& input;
+		bool first;
+	public:
+		explicit PPMStreamReader(Input& input);
+
+		//! Throws if the stream is empty
+		bool read(Frame& frame) override;
+		Image<float> decode(const Frame& frame, Preprocess& prep) const override;
+	};
+
+	//! Stream of YUV4MPEG2 frames (e.g. from ffmpeg -f yuv4mpegpipe)
+	/*!
+	The stream header is parsed once, by the constructor. Frames are converted to RGB at the resolution of
+	the chroma planes, or with luma set, only the Y plane is hashed and the chroma planes are skipped.
+	Supports 4:2:0, 4:2:2, 4:1:1, 4:4:4 and mono, with 8 to 16 bit samples.
+	*/
+	class Y4MStreamReader : public StreamReader
+	{
+		Input& input;
+		bool luma;
+		size_t width, height;
+		size_t sub_x, sub_y; // chroma subsampling, 0 for mono
+		size_t depth; // bits per sample
+		size_t alpha; // 1 if there is an alpha plane, else 0
+
+		size_t sample_size() const { return depth > 8 ? 2 : 1; }
+		size_t chroma_width() const { return (width + sub_x - 1) / sub_x; }
+		size_t chroma_height() const { return (height + sub_y - 1) / sub_y; }
+		size_t luma_size() const { return width * height * sample_size(); }
+		size_t chroma_size() const { return sub_x ? chroma_width() * chroma_height() * sample_size() : 0; }
+	public:
+		//! Throws if the stream header is invalid
+		Y4MStreamReader(Input& input, bool luma = false);
+
+		bool read(Frame& frame) override;
+		Image<float> decode(const Frame& frame, Preprocess& prep) const override;
+	};
+
+#ifdef USE_JPEG
+	//! Stream of concatenated JPEG images (e.g. from ffmpeg -f image2pipe -c:v mjpeg)
+	/*!
+	Each frame is found by walking its markers, without decoding it, then decoded from memory at reduced scale.
+	*/
+	class MJPEGStreamReader : public StreamReader
+	{
+		Input& input;
+	public:
+		explicit MJPEGStreamReader(Input& input);
+
+		bool read(Frame& frame) override;
+		Image<float> decode(const Frame& frame, Preprocess& prep) const override;
+	};
+#endif
+
+#ifdef USE_PNG
+	//! Stream of concatenated PNG images (e.g. from ffmpeg -f image2pipe -c:v png)
+	/*!
+	Each frame is found by walking its chunks, up to IEND, then decoded from memory.
+	*/
+	class PNGStreamReader : public StreamReader
+	{
+		Input& input;
+	public:
+		explicit PNGStreamReader(Input& input);
+
+		bool read(Frame& frame) override;
+		Image<float> decode(const Frame& frame, Preprocess& prep) const override;
+	};
+#endif
+
+	//! Hashes the frames of a stream on a thread pool
+	/*!
+	A reader thread reads frames into a ring of reusable buffers, the pool decodes and hashes them,
+	and next() hands back the hashes in stream order. The ring bounds the memory held: when the
+	consumer falls behind, the reader waits for a free buffer instead of reading ahead.
+	*/
+	class HashPipeline
+	{
+	public:
+		using hasher_factory = std::function<std::unique_ptr<Hasher>()>;
+
+		//! Start reading and hashing. Each of the `jobs` workers gets a Preprocess and a Hasher from make_hasher
+		HashPipeline(StreamReader& reader, size_t width, size_t height, const hasher_factory& make_hasher, size_t jobs);
+
+		//! Stop reading. Frames already read are discarded
+		~HashPipeline();
+
+		HashPipeline(const HashPipeline&) = delete;
+		HashPipeline& operator=(const HashPipeline&) = delete;
+
+		//! Wait for the hash of the next frame. Returns false at the end of the stream
+		/*!
+		Errors reading or hashing a frame are rethrown here, in order
+		*/
+		bool next(Hasher::hash_type& hash);
+
+	private:
+		struct result {
+			Hasher::hash_type hash;
+			std::exception_ptr error;
+			bool end = false;
+		};
+
+		void read_frames();
+
+		StreamReader& reader;
+		std::vector<Preprocess> preps;
+		std::vector<std::unique_ptr<Hasher>> hashers;
+		std::vector<Frame> frames;
+		BoundedQueue<Frame*> free_frames;
+		ReorderBuffer<result> results;
+		bool done;
+
+		//declared last, so that the workers are stopped before anything they use is destroyed
+		ThreadPool pool;
+		std::thread reader_thread;
+	};
+
+}
@@ -0,0 +1,108 @@
+#include "threadpool.h"
+
+namespace imghash {
+
+	namespace {
+		//which pool & worker the current thread belongs to
+		thread_local const ThreadPool* current_pool = nullptr;
+		thread_local size_t current_index = 0;
+	}
+
+	ThreadPool::ThreadPool(size_t num_threads)
+		: queued(0), pending(0), next(0), stop(false)
+	{
+		if (num_threads == 0) num_threads = 1;
+		workers.reserve(num_threads);
+		for (size_t i = 0; i < num_threads; ++i) {
+			workers.push_back(std::make_unique<Worker>());
+		}
+		threads.reserve(num_threads);
+		for (size_t i = 0; i < num_threads; ++i) {
+			threads.emplace_back(&ThreadPool::run, this, i);
+		}
+	}
+
+	ThreadPool::~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop = true;
+		}
+		cv_task.notify_all();
+		for (auto& t : threads) t.join();
+	}
+
+	void ThreadPool::submit(task_type task)
+	{
+		//workers keep their own tasks, so that related work stays together
+		size_t index = worker_index();
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (index >= workers.size()) {
+				index = next;
+				next = (next + 1) % workers.size();
+			}
+			++pending;
+			//counted before it's pushed, so that popping it never takes queued below zero
+			++queued;
+		}
+		{
+			std::lock_guard<std::mutex> lock(workers[index]->mutex);
+			workers[index]->tasks.push_back(std::move(task));
+		}
+		cv_task.notify_one();
+	}
+
+	void ThreadPool::wait()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		cv_done.wait(lock, [&] { return pending == 0; });
+	}
+
+	size_t ThreadPool::worker_index() const
+	{
+		return (current_pool == this) ? current_index : workers.size();
+	}
+
+	bool ThreadPool::pop(size_t index, task_type& task)
+	{
+		//own deque first, then steal from the others, starting with the next worker
+		for (size_t i = 0; i < workers.size(); ++i) {
+			auto& w = *workers[(index + i) % workers.size()];
+			std::lock_guard<std::mutex> lock(w.mutex);
+			if (!w.tasks.empty()) {
+				task = std::move(w.tasks.front());
+				w.tasks.pop_front();
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void ThreadPool::run(size_t index)
+	{
+		current_pool = this;
+		current_index = index;
+
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				cv_task.wait(lock, [&] { return stop || queued > 0; });
+				if (stop) return;
+			}
+			task_type task;
+			if (!pop(index, task)) continue; //another worker got it first
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				--queued;
+			}
+			task();
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				--pending;
+			}
+			cv_done.notify_all();
+		}
+	}
+
+}
@@ -0,0 +1,208 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <optional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdexcept>
+
+namespace imghash {
+
+	//! Work-stealing thread pool
+	/*!
+	Each worker has its own deque of tasks. Tasks submitted from outside of the pool are dealt
+	round-robin to the workers, tasks submitted by a worker go to its own deque. A worker runs the
+	oldest task in its own deque, and when that is empty it steals the oldest task from another
+	worker's, so a worker stuck on a slow task (e.g. a huge file) doesn't hold up the tasks behind it.
+	*/
+	class ThreadPool
+	{
+	public:
+		using task_type = std::function<void()>;
+
+		//! Start num_threads workers (at least 1)
+		explicit ThreadPool(size_t num_threads);
+
+		//! Stop the workers. Running tasks are finished, but queued tasks are discarded
+		~ThreadPool();
+
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool& operator=(const ThreadPool&) = delete;
+
+		//! The number of workers
+		size_t size() const { return workers.size(); }
+
+		//! Queue a task. Tasks must not throw
+		void submit(task_type task);
+
+		//! Wait until every task submitted so far has finished
+		void wait();
+
+		//! The index of the calling worker, in [0, size()), or size() if not called from a worker of this pool
+		/*!
+		Useful for giving each worker its own state, e.g. a Preprocess and Hasher
+		*/
+		size_t worker_index() const;
+
+	private:
+		struct Worker {
+			std::mutex mutex;
+			std::deque<task_type> tasks;
+		};
+
+		void run(size_t index);
+		bool pop(size_t index, task_type& task);
+
+		std::vector<std::unique_ptr<Worker>> workers;
+		std::vector<std::thread> threads;
+
+		std::mutex mutex;
+		std::condition_variable cv_task, cv_done;
+		size_t queued; // tasks waiting in the deques
+		size_t pending; // tasks submitted but not finished
+		size_t next; // the next worker to deal a task to
+		bool stop;
+	};
+
+	//! Hands back results produced out of order, in order
+	/*!
+	Results are indexed from 0. At most capacity results may be held at once: a producer calls
+	reserve(index) before starting on a result, which waits until the results before it have been taken.
+	*/
+	template<class T>
+	class ReorderBuffer
+	{
+		std::mutex mutex;
+		std::condition_variable cv_put, cv_take;
+		std::vector<std::optional<T>> slots;
+		size_t next; // the index of the next result to take
+		bool cancelled;
+
+	public:
+		explicit ReorderBuffer(size_t capacity)
+			: slots(capacity > 0 ? capacity : 1), next(0), cancelled(false)
+		{
+			//nothing else to do
+		}
+
+		size_t capacity() const { return slots.size(); }
+
+		//! Wait until there is room for the result with this index
+		/*!
+		Returns false if the buffer has been cancelled
+		*/
+		bool reserve(size_t index)
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			cv_take.wait(lock, [&] { return cancelled || index < next + slots.size(); });
+			return !cancelled;
+		}
+
+		//! Store a result. There must be room for it (see reserve)
+		/*!
+		Results put after the buffer has been cancelled are dropped
+		*/
+		void put(size_t index, T value)
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (cancelled) return;
+				if (index < next || index >= next + slots.size()) {
+					throw std::runtime_error("ReorderBuffer: index out of range");
+				}
+				slots[index % slots.size()] = std::move(value);
+			}
+			cv_put.notify_all();
+		}
+
+		//! Wait for the next result in order, and remove it
+		T take()
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			auto& slot = slots[next % slots.size()];
+			cv_put.wait(lock, [&] { return slot.has_value(); });
+			T value = std::move(*slot);
+			slot.reset();
+			++next;
+			lock.unlock();
+			cv_take.notify_all();
+			return value;
+		}
+
+		//! Stop taking results, releasing any producer waiting in reserve
+		void cancel()
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				cancelled = true;
+			}
+			cv_take.notify_all();
+		}
+	};
+
+	//! A fixed capacity FIFO queue for handing items between threads
+	/*!
+	push waits while the queue is full, so a fast producer is held back to the pace of its consumer.
+	*/
+	template<class T>
+	class BoundedQueue
+	{
+		std::mutex mutex;
+		std::condition_variable cv_push, cv_pop;
+		std::deque<T> items;
+		size_t cap;
+		bool closed;
+
+	public:
+		explicit BoundedQueue(size_t capacity)
+			: cap(capacity > 0 ? capacity : 1), closed(false)
+		{
+			//nothing else to do
+		}
+
+		size_t capacity() const { return cap; }
+
+		//! Wait until there is room, and add an item. Returns false if the queue has been closed
+		bool push(T value)
+		{
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				cv_pop.wait(lock, [&] { return closed || items.size() < cap; });
+				if (closed) return false;
+				items.push_back(std::move(value));
+			}
+			cv_push.notify_one();
+			return true;
+		}
+
+		//! Wait for an item, and remove it. Returns false if the queue has been closed
+		bool pop(T& value)
+		{
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				cv_push.wait(lock, [&] { return closed || !items.empty(); });
+				if (closed) return false;
+				value = std::move(items.front());
+				items.pop_front();
+			}
+			cv_pop.notify_one();
+			return true;
+		}
+
+		//! Release everything waiting on the queue. Later pushes and pops fail
+		void close()
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				closed = true;
+			}
+			cv_push.notify_all();
+			cv_pop.notify_all();
+		}
+	};
+
+}